@@ -0,0 +1,838 @@
+/*
+ * huffbench times encoding and decoding through the memory and file
+ * entry points on synthetic corpora, and reports throughput and the
+ * compression ratio (input size over output size). The corpora come
+ * from fixed seeds, so every build is measured on the same bytes. The
+ * batch path cuts the input into records of BATCH_RECORD bytes and
+ * codes them with one table built for the whole batch.
+ *
+ * Usage: huffbench [-s<sizes>] [-k<corpora>] [-j<threads>] [-r<runs>]
+ *                  [-o<csv file>] [-b<baseline csv>] [-t<percent>]
+ *
+ * -s  comma separated sizes, with an optional K, M or G suffix
+ *     (default 1K,64K,1M,16M; up to 1G)
+ * -k  comma separated corpora: text, json, random, skewed, single
+ *     (default all of them)
+ * -j  threads to encode and decode on (default 1)
+ * -r  timed samples per measurement, of which the best is kept
+ *     (default 5)
+ * -o  also write the results as CSV to the file
+ * -b  compare against the CSV of an earlier run; the exit status is
+ *     non-zero if a throughput fell by more than -t percent (default
+ *     10) or a ratio got worse
+ */
+#include "../huffman.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SIZES 16
+#define MAX_RESULTS 1024
+#define MAX_BENCH_SIZE ((size_t)1 << 30)
+
+/* Each sample repeats an operation until it takes this long, so small
+   inputs aren't lost in the resolution of the clock. */
+#define MIN_SAMPLE_TIME 0.005
+
+#define BATCH_RECORD 256
+
+static uint64_t
+next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    /* xorshift64* */
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Words in rough order of frequency in English; random_word picks
+ * them with Zipf's law, the word of rank r with weight 1/r.
+ */
+static const char *const words[] =
+{
+    "the", "of", "and", "to", "a", "in", "is", "that", "for", "it",
+    "was", "on", "with", "as", "he", "be", "by", "at", "have", "this",
+    "from", "or", "had", "not", "but", "are", "which", "they", "you",
+    "were", "his", "one", "all", "there", "been", "their", "an", "has",
+    "we", "more", "would", "when", "will", "who", "so", "no", "if",
+    "out", "time", "about", "into", "than", "them", "people", "only",
+    "could", "other", "new", "some", "these", "what", "first", "two",
+    "may", "then", "do", "any", "like", "my", "now", "over", "such",
+    "our", "man", "me", "even", "most", "made", "after", "also", "did",
+    "many", "before", "must", "through", "back", "years", "where",
+    "much", "your", "way", "well", "down", "should", "because", "each",
+    "just", "those", "how", "too", "little", "state", "good", "very",
+    "make", "world", "still", "own", "see", "men", "work", "long",
+    "here", "between", "both", "life", "being", "under", "never", "day",
+    "same", "another", "know", "while", "last", "might", "great", "old",
+    "year", "off", "come", "since", "against", "go", "came", "right",
+    "used", "take", "three", "request", "server", "latency", "cache",
+    "connection", "retry", "timeout", "user", "session", "token"
+};
+
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static const char*
+random_word(uint64_t *state)
+{
+    static uint32_t cumulative[NWORDS];
+    uint32_t r;
+    size_t lo = 0, hi = NWORDS - 1;
+
+    if(cumulative[0] == 0)
+    {
+        uint32_t total = 0;
+        size_t i;
+
+        for(i = 0; i < NWORDS; ++i)
+        {
+            total += 100000 / (uint32_t)(i + 1);
+            cumulative[i] = total;
+        }
+    }
+
+    r = (uint32_t)(next_random(state) % cumulative[NWORDS - 1]);
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+
+        if(cumulative[mid] > r)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return words[lo];
+}
+
+/*
+ * put_text copies as much of the string s as fits to buf at *ppos.
+ */
+static void
+put_text(unsigned char *buf, size_t len, size_t *ppos, const char *s)
+{
+    while(*s && *ppos < len)
+        buf[(*ppos)++] = (unsigned char)*s++;
+}
+
+/*
+ * fill_text writes sentences of 5 to 16 words, wrapped at 72 columns.
+ */
+static void
+fill_text(unsigned char *buf, size_t len, uint64_t *state)
+{
+    size_t pos = 0, column = 0;
+    unsigned int left = 0;
+
+    while(pos < len)
+    {
+        const char *w = random_word(state);
+        size_t start = pos;
+
+        /* A sentence starts with a capital letter. */
+        if(left == 0)
+        {
+            char first[2] = { 0, 0 };
+
+            left = 5 + (unsigned int)(next_random(state) % 12);
+            first[0] = (char)(*w++ - 'a' + 'A');
+            put_text(buf, len, &pos, first);
+        }
+
+        put_text(buf, len, &pos, w);
+        if(--left == 0)
+            put_text(buf, len, &pos, ".");
+
+        column += pos - start;
+        if(column >= 72)
+        {
+            put_text(buf, len, &pos, "\n");
+            column = 0;
+        }
+        else
+        {
+            put_text(buf, len, &pos, " ");
+            ++column;
+        }
+    }
+}
+
+/*
+ * fill_json writes JSON log records, one per line.
+ */
+static void
+fill_json(unsigned char *buf, size_t len, uint64_t *state)
+{
+    static const char *const levels[] = { "info", "info", "info", "debug",
+                                          "warn", "error" };
+    static const char *const services[] = { "auth", "billing", "search",
+                                            "gateway", "storage" };
+    char line[256];
+    size_t pos = 0;
+    uint64_t ms = 0;
+
+    while(pos < len)
+    {
+        uint64_t r = next_random(state);
+        unsigned int n, i;
+
+        ms += r % 2000;
+        snprintf(line, sizeof(line),
+                 "{\"ts\":\"2024-05-%02uT%02u:%02u:%02u.%03uZ\","
+                 "\"level\":\"%s\",\"service\":\"%s\","
+                 "\"request_id\":\"%016llx\",\"status\":%u,"
+                 "\"latency_ms\":%u,\"msg\":\"",
+                 (unsigned int)(1 + ms / 86400000 % 28),
+                 (unsigned int)(ms / 3600000 % 24),
+                 (unsigned int)(ms / 60000 % 60),
+                 (unsigned int)(ms / 1000 % 60),
+                 (unsigned int)(ms % 1000),
+                 levels[(r >> 16) % 6], services[(r >> 24) % 5],
+                 (unsigned long long)next_random(state),
+                 (r >> 32) % 10 ? 200u : 500u,
+                 (unsigned int)((r >> 40) % 900 + 1));
+        put_text(buf, len, &pos, line);
+
+        n = 3 + (unsigned int)((r >> 52) % 8);
+        for(i = 0; i < n; ++i)
+        {
+            put_text(buf, len, &pos, random_word(state));
+            put_text(buf, len, &pos, i + 1 < n ? " " : "\"}\n");
+        }
+    }
+}
+
+static void
+fill_random(unsigned char *buf, size_t len, uint64_t *state)
+{
+    size_t i;
+
+    for(i = 0; i < len; ++i)
+        buf[i] = (unsigned char)(next_random(state) >> 56);
+}
+
+/*
+ * fill_skewed writes bytes that take the value 'a' + k with
+ * probability 2^-(k+1), about two bits of information each.
+ */
+static void
+fill_skewed(unsigned char *buf, size_t len, uint64_t *state)
+{
+    size_t i;
+
+    for(i = 0; i < len; ++i)
+    {
+        uint64_t r = next_random(state);
+        unsigned char k = 0;
+
+        while(k < 63 && !(r & 1))
+        {
+            r >>= 1;
+            ++k;
+        }
+        buf[i] = (unsigned char)('a' + k);
+    }
+}
+
+static void
+fill_single(unsigned char *buf, size_t len, uint64_t *state)
+{
+    (void)state;
+    memset(buf, 'a', len);
+}
+
+typedef struct corpus_tag
+{
+    const char *name;
+    void (*fill)(unsigned char *buf, size_t len, uint64_t *state);
+} corpus;
+
+static const corpus corpora[] =
+{
+    { "text", fill_text },
+    { "json", fill_json },
+    { "random", fill_random },
+    { "skewed", fill_skewed },
+    { "single", fill_single }
+};
+
+#define NCORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+/*
+ * The buffers and files one size of one corpus is measured with. The
+ * file path reads and writes temporary files, which are regular files
+ * so the encoder maps its input as it would in use.
+ */
+typedef struct bench_state_tag
+{
+    huffman_options opts;
+    unsigned char *in;
+    size_t len;
+    unsigned char *enc;
+    size_t enccap;
+    size_t enclen;
+    unsigned char *dec;
+    FILE *fin;
+    FILE *fenc;
+    FILE *fdec;
+    huffman_buffer *records;
+    size_t nrecords;
+    huffman_table *table;
+    unsigned char *batch;
+    size_t *offsets;
+} bench_state;
+
+static int
+reset_file(FILE *f)
+{
+    rewind(f);
+    return ftruncate(fileno(f), 0) != 0;
+}
+
+static int
+memory_encode(bench_state *s)
+{
+    unsigned char *out;
+    size_t outlen;
+
+    if(s->opts.threads <= 1)
+        return huffman_encode_into(s->in, s->len, s->enc, s->enccap,
+                                   &s->enclen, &s->opts);
+
+    if(huffman_encode_memory_opts(s->in, s->len, &out, &outlen, &s->opts))
+        return 1;
+    free(out);
+    return outlen != s->enclen;
+}
+
+static int
+memory_decode(bench_state *s)
+{
+    unsigned char *out;
+    size_t outlen;
+
+    if(s->opts.threads <= 1)
+        return huffman_decode_into(s->enc, s->enclen, s->dec, s->len,
+                                   &outlen)
+               || outlen != s->len;
+
+    if(huffman_decode_memory_mt(s->enc, s->enclen, &out, &outlen,
+                                s->opts.threads))
+        return 1;
+    free(out);
+    return outlen != s->len;
+}
+
+static int
+file_encode(bench_state *s)
+{
+    rewind(s->fin);
+    return reset_file(s->fenc)
+           || huffman_encode_file_opts(s->fin, s->fenc, &s->opts)
+           || fflush(s->fenc) != 0;
+}
+
+static int
+file_decode(bench_state *s)
+{
+    rewind(s->fenc);
+    if(reset_file(s->fdec))
+        return 1;
+    if(s->opts.threads <= 1 ? huffman_decode_file(s->fenc, s->fdec)
+       : huffman_decode_file_mt(s->fenc, s->fdec, s->opts.threads))
+        return 1;
+    return fflush(s->fdec) != 0;
+}
+
+static int
+batch_encode(bench_state *s)
+{
+    huffman_table *t = NULL;
+    unsigned char *out;
+    size_t *offsets;
+    int rc;
+
+    if(huffman_encode_batch(s->records, s->nrecords, &s->opts, &t,
+                            &out, &offsets))
+        return 1;
+    rc = offsets[s->nrecords] != s->offsets[s->nrecords];
+    huffman_table_free(t);
+    free(out);
+    free(offsets);
+    return rc;
+}
+
+static int
+batch_decode(bench_state *s)
+{
+    unsigned char *out;
+    size_t *offsets;
+    int rc;
+
+    if(huffman_decode_batch(s->batch, s->offsets, s->nrecords, s->table,
+                            &s->opts, &out, &offsets))
+        return 1;
+    rc = offsets[s->nrecords] != s->len;
+    free(out);
+    free(offsets);
+    return rc;
+}
+
+/*
+ * setup_batch cuts the input into records and checks that a batch of
+ * them comes back as it went in, keeping the encoded batch and its
+ * table for batch_decode.
+ */
+static int
+setup_batch(bench_state *s)
+{
+    unsigned char *out;
+    size_t *offsets, i;
+    int rc;
+
+    s->nrecords = (s->len + BATCH_RECORD - 1) / BATCH_RECORD;
+    s->records = (huffman_buffer*)malloc(s->nrecords
+                                         * sizeof(*s->records));
+    if(!s->records)
+        return 1;
+    for(i = 0; i < s->nrecords; ++i)
+    {
+        s->records[i].data = s->in + i * BATCH_RECORD;
+        s->records[i].len = s->len - i * BATCH_RECORD < BATCH_RECORD
+                            ? s->len - i * BATCH_RECORD : BATCH_RECORD;
+    }
+
+    if(huffman_encode_batch(s->records, s->nrecords, &s->opts, &s->table,
+                            &s->batch, &s->offsets)
+       || huffman_decode_batch(s->batch, s->offsets, s->nrecords, s->table,
+                               &s->opts, &out, &offsets))
+        return 1;
+
+    rc = offsets[s->nrecords] != s->len || memcmp(out, s->in, s->len) != 0;
+    for(i = 0; rc == 0 && i < s->nrecords; ++i)
+        rc = offsets[i] != i * BATCH_RECORD;
+    free(out);
+    free(offsets);
+    return rc;
+}
+
+static void
+free_batch(bench_state *s)
+{
+    huffman_table_free(s->table);
+    free(s->records);
+    free(s->batch);
+    free(s->offsets);
+    s->table = NULL;
+    s->records = NULL;
+    s->batch = NULL;
+    s->offsets = NULL;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * time_op returns the best time op took over runs samples, in seconds
+ * per call, or a negative number if it failed.
+ */
+static double
+time_op(int (*op)(bench_state*), bench_state *s, unsigned int runs)
+{
+    unsigned long n = 1, i;
+    unsigned int r;
+    double best = 0;
+
+    for(;;)
+    {
+        double t = now();
+
+        for(i = 0; i < n; ++i)
+            if(op(s))
+                return -1;
+        if(now() - t >= MIN_SAMPLE_TIME || n >= 1ul << 20)
+            break;
+        n *= 2;
+    }
+
+    for(r = 0; r < runs; ++r)
+    {
+        double t = now();
+
+        for(i = 0; i < n; ++i)
+            if(op(s))
+                return -1;
+        t = (now() - t) / n;
+        if(r == 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+typedef struct result_tag
+{
+    char corpus[16];
+    size_t size;
+    char path[8];
+    char op[8];
+    double mbps;
+    double ratio;
+} result;
+
+static const result*
+find_result(const result *results, size_t n, const result *key)
+{
+    size_t i;
+
+    for(i = 0; i < n; ++i)
+        if(results[i].size == key->size
+           && strcmp(results[i].corpus, key->corpus) == 0
+           && strcmp(results[i].path, key->path) == 0
+           && strcmp(results[i].op, key->op) == 0)
+            return &results[i];
+    return NULL;
+}
+
+static int
+load_results(const char *name, result *results, size_t *pn)
+{
+    char line[256];
+    FILE *f = fopen(name, "r");
+
+    if(!f)
+    {
+        fprintf(stderr, "Can't open baseline file '%s'\n", name);
+        return 1;
+    }
+
+    *pn = 0;
+    while(*pn < MAX_RESULTS && fgets(line, sizeof(line), f))
+    {
+        result *r = &results[*pn];
+
+        if(sscanf(line, "%15[^,],%zu,%7[^,],%7[^,],%lf,%lf", r->corpus,
+                  &r->size, r->path, r->op, &r->mbps, &r->ratio) == 6)
+            ++*pn;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static void
+format_size(size_t size, char *buf, size_t buflen)
+{
+    if(size >= 1 << 30 && size % (1 << 30) == 0)
+        snprintf(buf, buflen, "%zuG", size >> 30);
+    else if(size >= 1 << 20 && size % (1 << 20) == 0)
+        snprintf(buf, buflen, "%zuM", size >> 20);
+    else if(size >= 1 << 10 && size % (1 << 10) == 0)
+        snprintf(buf, buflen, "%zuK", size >> 10);
+    else
+        snprintf(buf, buflen, "%zu", size);
+}
+
+static int
+parse_sizes(const char *arg, size_t *sizes, unsigned int *pn)
+{
+    const char *p = arg;
+
+    *pn = 0;
+    while(*p)
+    {
+        char *end;
+        unsigned long long v = strtoull(p, &end, 10);
+
+        if(end == p)
+            return 1;
+        if(*end == 'K' || *end == 'k')
+            v <<= 10, ++end;
+        else if(*end == 'M' || *end == 'm')
+            v <<= 20, ++end;
+        else if(*end == 'G' || *end == 'g')
+            v <<= 30, ++end;
+        if(v == 0 || v > MAX_BENCH_SIZE || *pn == MAX_SIZES
+           || (*end && *end != ','))
+            return 1;
+
+        sizes[(*pn)++] = (size_t)v;
+        p = *end ? end + 1 : end;
+    }
+
+    return *pn == 0;
+}
+
+static int
+parse_corpora(const char *arg, int *selected)
+{
+    const char *p = arg;
+    size_t i;
+
+    memset(selected, 0, NCORPORA * sizeof(*selected));
+    while(*p)
+    {
+        size_t n = strcspn(p, ",");
+
+        for(i = 0; i < NCORPORA; ++i)
+            if(strlen(corpora[i].name) == n
+               && strncmp(corpora[i].name, p, n) == 0)
+                break;
+        if(i == NCORPORA)
+            return 1;
+
+        selected[i] = 1;
+        p += n;
+        if(*p)
+            ++p;
+    }
+
+    return 0;
+}
+
+static void
+usage(FILE *out)
+{
+    fputs("Usage: huffbench [-s<sizes>] [-k<corpora>] [-j<threads>]"
+          " [-r<runs>] [-o<csv file>] [-b<baseline csv>] [-t<percent>]\n"
+          "-s - comma separated sizes such as 1K,64K,1M,1G"
+          " (default 1K,64K,1M,16M)\n"
+          "-k - comma separated corpora out of text, json, random,"
+          " skewed and single (default all)\n"
+          "-j - threads to encode and decode on (default 1)\n"
+          "-r - timed samples per measurement, best kept (default 5)\n"
+          "-o - also write the results as CSV to the file\n"
+          "-b - compare with the CSV of an earlier run and fail on"
+          " regressions\n"
+          "-t - throughput loss in percent that counts as a regression"
+          " (default 10)\n", out);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct
+    {
+        const char *path;
+        const char *op;
+        int (*fn)(bench_state*);
+    } ops[] =
+    {
+        { "memory", "encode", memory_encode },
+        { "memory", "decode", memory_decode },
+        { "file", "encode", file_encode },
+        { "file", "decode", file_decode },
+        { "batch", "encode", batch_encode },
+        { "batch", "decode", batch_decode }
+    };
+    size_t sizes[MAX_SIZES] = { 1 << 10, 64 << 10, 1 << 20, 16 << 20 };
+    unsigned int nsizes = 4, runs = 5, z, o;
+    int selected[NCORPORA];
+    static result baseline[MAX_RESULTS];
+    size_t nbaseline = 0, c;
+    const char *csvname = NULL, *basename = NULL;
+    double tolerance = 10;
+    bench_state s;
+    FILE *csv = NULL;
+    int opt, rc = 0, regressed = 0;
+
+    memset(&s, 0, sizeof(s));
+    huffman_options_init(&s.opts);
+    for(c = 0; c < NCORPORA; ++c)
+        selected[c] = 1;
+
+    while((opt = getopt(argc, argv, "s:k:j:r:o:b:t:h")) != -1)
+    {
+        switch(opt)
+        {
+        case 's':
+            if(parse_sizes(optarg, sizes, &nsizes))
+            {
+                fprintf(stderr, "Invalid sizes '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            if(parse_corpora(optarg, selected))
+            {
+                fprintf(stderr, "Invalid corpora '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            s.opts.threads = (unsigned int)atoi(optarg);
+            if(s.opts.threads < 1)
+                s.opts.threads = 1;
+            break;
+        case 'r':
+            runs = (unsigned int)atoi(optarg);
+            if(runs < 1)
+                runs = 1;
+            break;
+        case 'o':
+            csvname = optarg;
+            break;
+        case 'b':
+            basename = optarg;
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        case 'h':
+            usage(stdout);
+            return 0;
+        default:
+            usage(stderr);
+            return 1;
+        }
+    }
+
+    if(basename && load_results(basename, baseline, &nbaseline))
+        return 1;
+
+    if(csvname)
+    {
+        csv = fopen(csvname, "w");
+        if(!csv)
+        {
+            fprintf(stderr, "Can't open output file '%s'\n", csvname);
+            return 1;
+        }
+        fputs("corpus,size,path,op,mb_per_s,ratio\n", csv);
+    }
+
+    s.fin = tmpfile();
+    s.fenc = tmpfile();
+    s.fdec = tmpfile();
+    if(!s.fin || !s.fenc || !s.fdec)
+    {
+        fprintf(stderr, "Can't create temporary files\n");
+        return 1;
+    }
+
+    printf("%-8s %6s %-6s %-6s %10s %10s%s\n", "corpus", "size", "path",
+           "op", "MB/s", "ratio", nbaseline ? "  vs baseline" : "");
+
+    for(c = 0; rc == 0 && c < NCORPORA; ++c)
+    {
+        if(!selected[c])
+            continue;
+
+        for(z = 0; rc == 0 && z < nsizes; ++z)
+        {
+            uint64_t state = 0x9E3779B97F4A7C15ULL * (c + 1);
+            char sizename[24];
+
+            s.len = sizes[z];
+            s.enccap = huffman_encode_bound(s.len);
+            s.in = (unsigned char*)malloc(s.len);
+            s.enc = (unsigned char*)malloc(s.enccap);
+            s.dec = (unsigned char*)malloc(s.len);
+            if(!s.in || !s.enc || !s.dec)
+            {
+                fprintf(stderr, "Out of memory\n");
+                rc = 1;
+            }
+
+            /* Lay out the input file and check that both paths give
+               back what went in before timing anything. */
+            if(rc == 0)
+            {
+                corpora[c].fill(s.in, s.len, &state);
+                rc = reset_file(s.fin)
+                     || fwrite(s.in, 1, s.len, s.fin) != s.len
+                     || fflush(s.fin) != 0
+                     || huffman_encode_into(s.in, s.len, s.enc, s.enccap,
+                                            &s.enclen, &s.opts)
+                     || memory_decode(&s)
+                     || memcmp(s.dec, s.in, s.len) != 0
+                     || file_encode(&s)
+                     || (size_t)ftell(s.fenc) != s.enclen
+                     || file_decode(&s)
+                     || fseek(s.fdec, 0, SEEK_SET) != 0
+                     || fread(s.dec, 1, s.len, s.fdec) != s.len
+                     || memcmp(s.dec, s.in, s.len) != 0
+                     || setup_batch(&s);
+                if(rc)
+                    fprintf(stderr, "%s, %zu bytes: round trip failed\n",
+                            corpora[c].name, s.len);
+            }
+
+            format_size(s.len, sizename, sizeof(sizename));
+            for(o = 0; rc == 0 && o < sizeof(ops) / sizeof(ops[0]); ++o)
+            {
+                double t = time_op(ops[o].fn, &s, runs);
+                const result *base;
+                result r;
+
+                if(t < 0)
+                {
+                    fprintf(stderr, "%s, %zu bytes: %s %s failed\n",
+                            corpora[c].name, s.len, ops[o].path, ops[o].op);
+                    rc = 1;
+                    break;
+                }
+
+                memset(&r, 0, sizeof(r));
+                snprintf(r.corpus, sizeof(r.corpus), "%s", corpora[c].name);
+                snprintf(r.path, sizeof(r.path), "%s", ops[o].path);
+                snprintf(r.op, sizeof(r.op), "%s", ops[o].op);
+                r.size = s.len;
+                r.mbps = t > 0 ? s.len / t / 1e6 : 0;
+                r.ratio = (double)s.len / (strcmp(r.path, "batch") == 0
+                                           ? s.offsets[s.nrecords]
+                                           : s.enclen);
+
+                printf("%-8s %6s %-6s %-6s %10.1f %10.3f", r.corpus, sizename,
+                       r.path, r.op, r.mbps, r.ratio);
+                base = find_result(baseline, nbaseline, &r);
+                if(base)
+                {
+                    int slower = r.mbps < base->mbps * (1 - tolerance / 100);
+                    int larger = r.ratio < base->ratio * (1 - 1e-4);
+
+                    printf("  %+7.1f%%%s%s",
+                           base->mbps > 0
+                           ? 100 * (r.mbps - base->mbps) / base->mbps : 0,
+                           slower ? " slower" : "", larger ? " larger" : "");
+                    regressed |= slower || larger;
+                }
+                putchar('\n');
+
+                if(csv)
+                    fprintf(csv, "%s,%zu,%s,%s,%.1f,%.4f\n", r.corpus,
+                            r.size, r.path, r.op, r.mbps, r.ratio);
+            }
+
+            free_batch(&s);
+            free(s.in);
+            free(s.enc);
+            free(s.dec);
+        }
+    }
+
+    fclose(s.fin);
+    fclose(s.fenc);
+    fclose(s.fdec);
+    if(csv && fclose(csv) != 0)
+        rc = 1;
+
+    fflush(stdout);
+    if(regressed)
+        fprintf(stderr, "Regressions against '%s'\n", basename);
+    return rc || regressed;
+}
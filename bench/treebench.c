@@ -0,0 +1,163 @@
+/*
+ * treebench times building the code lengths of one table, the cost
+ * paid per block and so per message when many small buffers are
+ * compressed. It compares calculate_code_lengths with the builder it
+ * replaced, which sorted every node again after each merge.
+ */
+#include "../huffman.c"
+
+#include <time.h>
+
+typedef struct old_node_tag
+{
+    uint64_t count;
+    int symbol;
+    struct old_node_tag *zero, *one;
+} old_node;
+
+static int
+old_node_cmp(const void *p1, const void *p2)
+{
+    const old_node *hn1 = *(const old_node**)p1;
+    const old_node *hn2 = *(const old_node**)p2;
+
+    if(hn1 == NULL && hn2 == NULL)
+        return 0;
+    if(hn1 == NULL)
+        return 1;
+    if(hn2 == NULL)
+        return -1;
+    if(hn1->count != hn2->count)
+        return hn1->count > hn2->count ? 1 : -1;
+    return 0;
+}
+
+static void
+old_lengths(const old_node *p, unsigned int depth, unsigned char *lens)
+{
+    if(p->symbol >= 0)
+    {
+        lens[p->symbol] = (unsigned char)depth;
+        return;
+    }
+    old_lengths(p->zero, depth + 1, lens);
+    old_lengths(p->one, depth + 1, lens);
+}
+
+static void
+old_free(old_node *p)
+{
+    if(p->symbol < 0)
+    {
+        old_free(p->zero);
+        old_free(p->one);
+    }
+    free(p);
+}
+
+static void
+old_code_lengths(const uint64_t *counts, unsigned char *lens)
+{
+    old_node *sf[MAX_SYMBOLS];
+    unsigned int i, n;
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+    {
+        sf[i] = NULL;
+        if(counts[i])
+        {
+            sf[i] = (old_node*)calloc(1, sizeof(old_node));
+            sf[i]->count = counts[i];
+            sf[i]->symbol = (int)i;
+        }
+    }
+
+    qsort(sf, MAX_SYMBOLS, sizeof(sf[0]), old_node_cmp);
+    for(n = 0; n < MAX_SYMBOLS && sf[n]; ++n)
+        ;
+
+    for(i = 1; i < n; ++i)
+    {
+        old_node *p = (old_node*)calloc(1, sizeof(old_node));
+        p->count = sf[0]->count + sf[1]->count;
+        p->symbol = -1;
+        p->zero = sf[0];
+        p->one = sf[1];
+        sf[0] = p;
+        sf[1] = NULL;
+        qsort(sf, n, sizeof(sf[0]), old_node_cmp);
+    }
+
+    memset(lens, 0, MAX_SYMBOLS);
+    if(n > 0)
+    {
+        old_lengths(sf[0], 0, lens);
+        old_free(sf[0]);
+    }
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+cost(const uint64_t *counts, const unsigned char *lens)
+{
+    uint64_t bits = 0;
+    unsigned int i;
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+        bits += counts[i] * lens[i];
+    return bits;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const unsigned int alphabets[] = { 16, 64, 256 };
+    unsigned int runs = argc > 1 ? (unsigned int)atoi(argv[1]) : 20000;
+    unsigned int a, i, r;
+    int rc = 0;
+
+    printf("%-10s %14s %14s %8s\n", "symbols", "old tables/s", "new tables/s",
+           "speedup");
+
+    for(a = 0; a < sizeof(alphabets) / sizeof(alphabets[0]); ++a)
+    {
+        uint64_t counts[MAX_SYMBOLS];
+        unsigned char lens[MAX_SYMBOLS], oldlens[MAX_SYMBOLS];
+        double t0, t1, t2;
+
+        /* A skewed, text-like distribution over the alphabet. */
+        memset(counts, 0, sizeof(counts));
+        srand(a + 1);
+        for(i = 0; i < alphabets[a]; ++i)
+            counts[(i * 97) % MAX_SYMBOLS] = 1 + (uint64_t)(rand() % 1000)
+                                             * (alphabets[a] - i);
+
+        t0 = now();
+        for(r = 0; r < runs; ++r)
+            old_code_lengths(counts, oldlens);
+        t1 = now();
+        for(r = 0; r < runs; ++r)
+            calculate_code_lengths(counts, HUFFMAN_MAX_CODE_LENGTH, lens);
+        t2 = now();
+
+        if(cost(counts, lens) != cost(counts, oldlens))
+        {
+            fprintf(stderr, "%u symbols: code lengths are not optimal\n",
+                    alphabets[a]);
+            rc = 1;
+        }
+
+        printf("%-10u %14.0f %14.0f %7.1fx\n", alphabets[a],
+               runs / (t1 - t0), runs / (t2 - t1), (t1 - t0) / (t2 - t1));
+    }
+
+    return rc;
+}
@@ -3,37 +3,313 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <assert.h>
 #include <unistd.h>
 
 static void
 usage(FILE* out)
 {
-    fputs("Usage: huffcode [-i<input file>] [-o<output file>] [-d|-c]\n"
+    fputs("Usage: huffcode [-i<input file>] [-o<output file>] [-j<threads>]"
+          " [-l<bits>] [-s<streams>] [-f] [-m] [-p] [-v]\n"
+          "                [-T<table file>] [-d|-c]\n"
+          "       huffcode -t [-n<id>] [-l<bits>] [-i<sample file>]"
+          " [-o<table file>]\n"
           "-i - input file (default is standard input)\n"
           "-o - output file (default is standard output)\n"
+          "-j - number of threads to use (default 1)\n"
+          "-l - longest code to use when escaping, 8 to 56 bits"
+          " (default 56)\n"
+          "-s - bit streams per block when escaping, 1 or 4 (default 4)\n"
+          "-f - escape faster, building codes from a sample of the input\n"
+          "-m - read all the input into memory and code it there\n"
+          "-p - read and write on separate threads while coding\n"
+          "-v - print the time spent in each phase to standard error\n"
+          "-T - escape or unescape one message with a trained table\n"
+          "-t - train a table on the input and write it to the output\n"
+          "-n - ID of the trained table (default 0)\n"
           "-d - unescape\n"
           "-c - escape (default)\n",
           out);
 }
 
+/*
+ * read_all reads the rest of in into a malloc'd buffer.
+ */
+static int
+read_all(FILE *in, unsigned char **pbuf, size_t *plen)
+{
+    unsigned char *buf = NULL, *tmp;
+    size_t len = 0, cap = 0, got;
+
+    do
+    {
+        if(len == cap)
+        {
+            cap = cap ? cap * 2 : 65536;
+            tmp = (unsigned char*)realloc(buf, cap);
+            if(!tmp)
+            {
+                free(buf);
+                return 1;
+            }
+            buf = tmp;
+        }
+        got = fread(buf + len, 1, cap - len, in);
+        len += got;
+    } while(got > 0);
+
+    if(ferror(in))
+    {
+        free(buf);
+        return 1;
+    }
+
+    *pbuf = buf;
+    *plen = len;
+    return 0;
+}
+
+static int
+train_table(FILE *in, FILE *out, uint32_t id, const huffman_options *opts)
+{
+    unsigned char *sample, *buf;
+    size_t samplelen, len;
+    huffman_table *t;
+    int rc;
+
+    if(read_all(in, &sample, &samplelen))
+        return 1;
+
+    rc = huffman_table_train(sample, samplelen, id, opts, &t);
+    free(sample);
+    if(rc)
+        return 1;
+
+    rc = huffman_table_save(t, &buf, &len);
+    huffman_table_free(t);
+    if(rc)
+        return 1;
+
+    rc = fwrite(buf, 1, len, out) != len;
+    free(buf);
+    return rc;
+}
+
+/*
+ * code_with_table encodes or decodes in as one message with the table
+ * in file_table.
+ */
+static int
+code_with_table(FILE *in, FILE *out, const char *file_table, char compress)
+{
+    FILE *tf;
+    unsigned char *tbuf, *msg, *res = NULL;
+    size_t tlen, msglen, cap, reslen = 0;
+    huffman_table *t;
+    uint64_t size;
+    uint32_t id;
+    int rc;
+
+    tf = fopen(file_table, "rb");
+    if(!tf)
+    {
+        fprintf(stderr,
+                "Can't open table file '%s': %s\n",
+                file_table, strerror(errno));
+        return 1;
+    }
+    rc = read_all(tf, &tbuf, &tlen);
+    fclose(tf);
+    if(rc)
+        return 1;
+
+    rc = huffman_table_load(tbuf, tlen, &t);
+    free(tbuf);
+    if(rc)
+    {
+        fprintf(stderr, "Invalid table file '%s'\n", file_table);
+        return 1;
+    }
+
+    if(read_all(in, &msg, &msglen))
+    {
+        huffman_table_free(t);
+        return 1;
+    }
+
+    if(compress)
+    {
+        cap = huffman_table_encode_bound(t, msglen);
+        res = cap ? (unsigned char*)malloc(cap) : NULL;
+        rc = !res || huffman_encode_with_table(t, msg, msglen,
+                                               res, cap, &reslen);
+    }
+    else if(huffman_message_info(msg, msglen, &id, &size) || size > SIZE_MAX)
+    {
+        rc = 1;
+    }
+    else if(id != huffman_table_id(t))
+    {
+        fprintf(stderr, "Message uses table %u, not %u\n",
+                (unsigned int)id, (unsigned int)huffman_table_id(t));
+        rc = 1;
+    }
+    else
+    {
+        res = (unsigned char*)malloc(size ? (size_t)size : 1);
+        rc = !res || huffman_decode_with_table(t, msg, msglen,
+                                               res, (size_t)size, &reslen);
+    }
+
+    if(rc == 0)
+        rc = fwrite(res, 1, reslen, out) != reslen;
+
+    free(res);
+    free(msg);
+    huffman_table_free(t);
+    return rc;
+}
+
+/*
+ * code_in_memory reads all of in, encodes or decodes it in memory and
+ * writes the result to out.
+ */
+static int
+code_in_memory(FILE *in, FILE *out, char compress,
+               const huffman_options *opts)
+{
+    unsigned char *buf, *res = NULL;
+    size_t len, reslen = 0;
+    int rc;
+
+    if(read_all(in, &buf, &len))
+        return 1;
+
+    rc = compress
+         ? huffman_encode_memory_opts(buf, len, &res, &reslen, opts)
+         : huffman_decode_memory_opts(buf, len, &res, &reslen, opts);
+    if(rc == 0)
+        rc = fwrite(res, 1, reslen, out) != reslen;
+
+    free(res);
+    free(buf);
+    return rc;
+}
+
+static void
+print_stats(FILE *out, const huffman_stats *stats)
+{
+    static const char *names[HUFFMAN_PHASES] =
+    {
+        "read", "histogram", "tree", "table", "encode", "decode", "write"
+    };
+    const huffman_phase *p;
+    double mb;
+    unsigned int i;
+
+    fprintf(out, "%-10s %10s %10s %10s\n", "phase", "seconds", "MB", "MB/s");
+    for(i = 0; i < HUFFMAN_PHASES; ++i)
+    {
+        p = &stats->phases[i];
+        if(p->seconds == 0 && p->bytes == 0)
+            continue;
+        mb = (double)p->bytes / 1e6;
+        fprintf(out, "%-10s %10.4f %10.2f %10.1f\n", names[i], p->seconds,
+                mb, p->seconds > 0 ? mb / p->seconds : 0.0);
+    }
+    fprintf(out, "%-10s %10.4f\n", "total", stats->seconds);
+    fprintf(out, "allocations %llu, longest code %u bits\n",
+            (unsigned long long)stats->allocations, stats->max_code_length);
+}
+
 int
 main(int argc, char** argv)
 {
     char compress = 1;
+    char train = 0;
+    char memory = 0;
+    char verbose = 0;
     int opt;
-    const char *file_in = NULL, *file_out = NULL;
+    const char *file_in = NULL, *file_out = NULL, *file_table = NULL;
     FILE *in = stdin;
     FILE *out = stdout;
     int close_in = 0;
     int close_out = 0;
     int rc = 0;
+    unsigned int threads = 1;
+    huffman_options opts;
+    huffman_stats stats;
+    unsigned long bits, id = 0;
+    char *end;
+
+    huffman_options_init(&opts);
 
     /* Get the command line arguments. */
-    while((opt = getopt(argc, argv, "i:o:cdhvm")) != -1)
+    while((opt = getopt(argc, argv, "i:o:j:l:s:n:T:ftcdhvmp")) != -1)
     {
         switch(opt)
         {
+        case 'j':
+            errno = 0;
+            bits = strtoul(optarg, &end, 10);
+            if(errno || end == optarg || *end || bits == 0
+               || bits > UINT_MAX)
+            {
+                fprintf(stderr, "Invalid thread count '%s'\n", optarg);
+                return 1;
+            }
+            threads = (unsigned int)bits;
+            break;
+        case 'l':
+            errno = 0;
+            bits = strtoul(optarg, &end, 10);
+            if(errno || end == optarg || *end
+               || bits < HUFFMAN_MIN_CODE_LENGTH
+               || bits > HUFFMAN_MAX_CODE_LENGTH)
+            {
+                fprintf(stderr, "Invalid code length '%s'\n", optarg);
+                return 1;
+            }
+            opts.max_code_length = (unsigned int)bits;
+            break;
+        case 's':
+            errno = 0;
+            bits = strtoul(optarg, &end, 10);
+            if(errno || end == optarg || *end || (bits != 1 && bits != 4))
+            {
+                fprintf(stderr, "Invalid stream count '%s'\n", optarg);
+                return 1;
+            }
+            opts.streams = (unsigned int)bits;
+            break;
+        case 'f':
+            opts.fast = 1;
+            break;
+        case 'm':
+            memory = 1;
+            break;
+        case 'p':
+            opts.pipeline = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            errno = 0;
+            id = strtoul(optarg, &end, 10);
+            if(errno || end == optarg || *end || id > UINT32_MAX)
+            {
+                fprintf(stderr, "Invalid table ID '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'T':
+            file_table = optarg;
+            break;
+        case 't':
+            train = 1;
+            break;
         case 'i':
             file_in = optarg;
             break;
@@ -83,13 +359,30 @@ main(int argc, char** argv)
         close_out = 1;
     }
 
-    if (compress)
+    if (train)
     {
-        rc = huffman_encode_file(in, out);
+        rc = train_table(in, out, (uint32_t)id, &opts);
+    }
+    else if (file_table)
+    {
+        rc = code_with_table(in, out, file_table, compress);
     }
     else
     {
-        rc = huffman_decode_file(in, out);
+        opts.threads = threads;
+        memset(&stats, 0, sizeof(stats));
+        if (verbose)
+            opts.stats = &stats;
+
+        if (memory)
+            rc = code_in_memory(in, out, compress, &opts);
+        else if (compress)
+            rc = huffman_encode_file_opts(in, out, &opts);
+        else
+            rc = huffman_decode_file_opts(in, out, &opts);
+
+        if (verbose)
+            print_stats(stderr, &stats);
     }
 
     if (close_in)
@@ -5,516 +5,1071 @@
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 
-typedef struct huffman_node_tag
+/*
+ * Kernels that gain from newer x86 instructions are built in plain C
+ * and again for each such feature set, and bind_kernels points their
+ * callers at the best versions the CPU has when the library is
+ * loaded, so one build runs everywhere. A KERNEL_BODY holds the code
+ * of a kernel and is inlined into each version, which the compiler
+ * then generates for that version's target.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HUFFMAN_DISPATCH 1
+#define KERNEL_BODY static inline __attribute__((always_inline))
+#define TARGET(features) __attribute__((target(features)))
+#include <immintrin.h>
+#else
+#define HUFFMAN_DISPATCH 0
+#define KERNEL_BODY static inline
+#endif
+
+
+/*
+ * Statistics.
+ *
+ * A call given a huffman_stats points cur_stats at it while it runs,
+ * as do the threads it starts, so the code below records into it
+ * without the stats being passed down. Phases are timed a block or a
+ * buffer at a time and added up under stats_lock.
+ */
+static _Thread_local huffman_stats *cur_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * stats_clock returns the time in seconds, or 0 if no stats are kept.
+ */
+static double
+stats_clock(void)
 {
-    unsigned char isLeaf;
-    unsigned long count;
-    struct huffman_node_tag *parent;
+    struct timespec ts;
 
-    union
-    {
-        struct
-        {
-            struct huffman_node_tag *zero, *one;
-        };
-        unsigned char symbol;
-    };
-} huffman_node;
+    if(!cur_stats)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-typedef struct huffman_code_tag
+/*
+ * add_phase adds the time since start, as returned by stats_clock, and
+ * bytes to a phase.
+ */
+static void
+add_phase(unsigned int phase, double start, uint64_t bytes)
 {
-    unsigned long numbits;
-    unsigned char *bits;
-} huffman_code;
+    double t;
 
-static unsigned long
-numbytes_from_numbits(unsigned long numbits)
+    if(!cur_stats)
+        return;
+
+    t = stats_clock() - start;
+    pthread_mutex_lock(&stats_lock);
+    cur_stats->phases[phase].seconds += t;
+    cur_stats->phases[phase].bytes += bytes;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void
+note_code_length(unsigned int len)
 {
-    return numbits / 8 + (numbits % 8 ? 1 : 0);
+    if(!cur_stats)
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    if(len > cur_stats->max_code_length)
+        cur_stats->max_code_length = len;
+    pthread_mutex_unlock(&stats_lock);
 }
 
 /*
- * get_bit returns the ith bit in the bits array
- * in the 0th position of the return value.
+ * The library allocates through these so its allocations can be
+ * counted.
  */
-static unsigned char
-get_bit(unsigned char* bits, unsigned long i)
+static void
+note_allocation(void)
 {
-    return (bits[i / 8] >> i % 8) & 1;
+    if(!cur_stats)
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    ++cur_stats->allocations;
+    pthread_mutex_unlock(&stats_lock);
 }
 
-static void
-reverse_bits(unsigned char* bits, unsigned long numbits)
+static void*
+counted_malloc(size_t size)
+{
+    note_allocation();
+    return malloc(size);
+}
+
+static void*
+counted_calloc(size_t n, size_t size)
 {
-    unsigned long numbytes = numbytes_from_numbits(numbits);
-    unsigned char *tmp =
-        (unsigned char*)malloc(numbytes);
-    unsigned long curbit;
-    long curbyte = 0;
+    note_allocation();
+    return calloc(n, size);
+}
 
-    memset(tmp, 0, numbytes);
+static void*
+counted_realloc(void *p, size_t size)
+{
+    note_allocation();
+    return realloc(p, size);
+}
 
-    for(curbit = 0; curbit < numbits; ++curbit)
-    {
-        unsigned int bitpos = curbit % 8;
+/*
+ * timed_read and timed_write are fread and fwrite of bytes, counted in
+ * the read and write phases.
+ */
+static size_t
+timed_read(void *buf, size_t len, FILE *in)
+{
+    double start = stats_clock();
+    size_t got = fread(buf, 1, len, in);
 
-        if(curbit > 0 && curbit % 8 == 0)
-            ++curbyte;
+    add_phase(HUFFMAN_PHASE_READ, start, got);
+    return got;
+}
 
-        tmp[curbyte] |= (get_bit(bits, numbits - curbit - 1) << bitpos);
-    }
+static size_t
+timed_write(const void *buf, size_t len, FILE *out)
+{
+    double start = stats_clock();
+    size_t put = fwrite(buf, 1, len, out);
 
-    memcpy(bits, tmp, numbytes);
-    free(tmp);
+    add_phase(HUFFMAN_PHASE_WRITE, start, put);
+    return put;
 }
 
 /*
- * new_code builds a huffman_code from a leaf in
- * a Huffman tree.
+ * Pipelined file I/O.
+ *
+ * When a call pipelines its files, a reader thread fills a ring of
+ * large buffers from the input ahead of the coder and a writer thread
+ * empties a second ring into the output behind it, so the calling
+ * thread codes while they wait on the files. The call points cur_pipe
+ * at its rings while it runs, and read_input and write_output take
+ * its input and output through them.
  */
-static huffman_code*
-new_code(const huffman_node* leaf)
+#define PIPE_BUFFERS 3
+#define PIPE_CHUNK ((size_t)1 << 20)
+
+typedef struct io_ring_tag
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    FILE *file;
+    huffman_stats *stats;
+    unsigned char *bufs[PIPE_BUFFERS];
+    size_t lens[PIPE_BUFFERS];
+    /* Buffers filled and emptied so far, and how far the calling
+       thread has got into its current buffer. */
+    size_t filled;
+    size_t emptied;
+    size_t pos;
+    /* Bytes the reader has read and the caller has taken, for seeking
+       back over what was read ahead. */
+    uint64_t got;
+    uint64_t used;
+    /* Set when the side that fills the ring has no more, when the
+       other side wants no more, and on a write error. */
+    int closed;
+    int stop;
+    int failed;
+    int ready;
+} io_ring;
+
+typedef struct file_pipeline_tag
+{
+    io_ring in;
+    io_ring out;
+    off_t start;
+} file_pipeline;
+
+static _Thread_local file_pipeline *cur_pipe;
+
+static void*
+reader_main(void *arg)
 {
-    unsigned long numbits = 0;
-    unsigned char* bits = NULL;
-    huffman_code *p;
+    io_ring *r = (io_ring*)arg;
 
-    while(leaf && leaf->parent)
+    cur_stats = r->stats;
+    for(;;)
     {
-        huffman_node *parent = leaf->parent;
-        unsigned char cur_bit = (unsigned char)(numbits % 8);
-        unsigned long cur_byte = numbits / 8;
+        size_t i, got;
+        int closed;
 
-        if(cur_bit == 0)
+        pthread_mutex_lock(&r->lock);
+        while(!r->stop && r->filled - r->emptied == PIPE_BUFFERS)
+            pthread_cond_wait(&r->cond, &r->lock);
+        if(r->stop)
         {
-            size_t newSize = cur_byte + 1;
-            bits = (unsigned char*)realloc(bits, newSize);
-            bits[newSize - 1] = 0;
+            pthread_mutex_unlock(&r->lock);
+            return NULL;
         }
+        i = r->filled % PIPE_BUFFERS;
+        pthread_mutex_unlock(&r->lock);
 
-        if(leaf == parent->one)
-            bits[cur_byte] |= 1 << cur_bit;
-
-        ++numbits;
-        leaf = parent;
-    }
+        /* fread only comes up short at the end or on an error. */
+        got = timed_read(r->bufs[i], PIPE_CHUNK, r->file);
 
-    if(bits)
-        reverse_bits(bits, numbits);
+        pthread_mutex_lock(&r->lock);
+        r->lens[i] = got;
+        r->got += got;
+        ++r->filled;
+        closed = r->closed = got < PIPE_CHUNK;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
 
-    p = (huffman_code*)malloc(sizeof(huffman_code));
-    p->numbits = numbits;
-    p->bits = bits;
-    return p;
+        if(closed)
+            return NULL;
+    }
 }
 
-#define MAX_SYMBOLS 256
-typedef huffman_node* SymbolFrequencies[MAX_SYMBOLS];
-typedef huffman_code* SymbolEncoder[MAX_SYMBOLS];
-
-static huffman_node*
-new_leaf_node(unsigned char symbol)
+static void*
+writer_main(void *arg)
 {
-    huffman_node *p = (huffman_node*)malloc(sizeof(huffman_node));
-    p->isLeaf = 1;
-    p->symbol = symbol;
-    p->count = 0;
-    p->parent = 0;
-    return p;
-}
+    io_ring *r = (io_ring*)arg;
 
-static huffman_node*
-new_nonleaf_node(unsigned long count, huffman_node *zero, huffman_node *one)
-{
-    huffman_node *p = (huffman_node*)malloc(sizeof(huffman_node));
-    p->isLeaf = 0;
-    p->count = count;
-    p->zero = zero;
-    p->one = one;
-    p->parent = 0;
+    cur_stats = r->stats;
+    for(;;)
+    {
+        size_t i;
+        int failed;
 
-    return p;
-}
+        pthread_mutex_lock(&r->lock);
+        while(!r->closed && r->emptied == r->filled)
+            pthread_cond_wait(&r->cond, &r->lock);
+        if(r->emptied == r->filled)
+        {
+            pthread_mutex_unlock(&r->lock);
+            return NULL;
+        }
+        i = r->emptied % PIPE_BUFFERS;
+        pthread_mutex_unlock(&r->lock);
 
-static void
-free_huffman_tree(huffman_node *subtree)
-{
-    if(subtree == NULL)
-        return;
+        failed = timed_write(r->bufs[i], r->lens[i], r->file) != r->lens[i];
 
-    if(!subtree->isLeaf)
-    {
-        free_huffman_tree(subtree->zero);
-        free_huffman_tree(subtree->one);
-    }
+        pthread_mutex_lock(&r->lock);
+        if(failed)
+            r->failed = 1;
+        else
+            ++r->emptied;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
 
-    free(subtree);
+        if(failed)
+            return NULL;
+    }
 }
 
-static void
-free_code(huffman_code* p)
+/*
+ * ring_read copies up to len bytes from the input ring into buf,
+ * returning fewer only at the end of the input or on an error.
+ */
+static size_t
+ring_read(io_ring *r, unsigned char *buf, size_t len)
 {
-    free(p->bits);
-    free(p);
-}
+    size_t got = 0;
 
-static void
-free_encoder(SymbolEncoder *pSE)
-{
-    unsigned long i;
-    for(i = 0; i < MAX_SYMBOLS; ++i)
+    while(got < len)
     {
-        huffman_code *p = (*pSE)[i];
-        if(p)
-            free_code(p);
+        size_t i = r->emptied % PIPE_BUFFERS, n;
+        int avail;
+
+        pthread_mutex_lock(&r->lock);
+        while(!r->closed && r->emptied == r->filled)
+            pthread_cond_wait(&r->cond, &r->lock);
+        avail = r->emptied < r->filled;
+        pthread_mutex_unlock(&r->lock);
+        if(!avail)
+            break;
+
+        n = r->lens[i] - r->pos < len - got ? r->lens[i] - r->pos
+                                             : len - got;
+        memcpy(buf + got, r->bufs[i] + r->pos, n);
+        r->pos += n;
+        got += n;
+
+        if(r->pos == r->lens[i])
+        {
+            pthread_mutex_lock(&r->lock);
+            ++r->emptied;
+            r->pos = 0;
+            pthread_cond_signal(&r->cond);
+            pthread_mutex_unlock(&r->lock);
+        }
     }
 
-    free(pSE);
+    r->used += got;
+    return got;
 }
 
+/*
+ * push_buffer hands the current buffer of the output ring to the
+ * writer.
+ */
 static void
-init_frequencies(SymbolFrequencies pSF)
+push_buffer(io_ring *r)
 {
-    memset(pSF, 0, sizeof(SymbolFrequencies));
+    pthread_mutex_lock(&r->lock);
+    r->lens[r->filled % PIPE_BUFFERS] = r->pos;
+    ++r->filled;
+    r->pos = 0;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
 }
 
-typedef struct buf_cache_tag
+/*
+ * ring_write copies the len bytes at buf into the output ring,
+ * returning fewer once the writer has failed.
+ */
+static size_t
+ring_write(io_ring *r, const unsigned char *buf, size_t len)
 {
-    unsigned char *cache;
-    unsigned int cache_len;
-    unsigned int cache_cur;
-    unsigned char **pbufout;
-    unsigned int *pbufoutlen;
-} buf_cache;
+    size_t put = 0;
 
-static int init_cache(buf_cache* pc,
-                      unsigned int cache_size,
-                      unsigned char **pbufout,
-                      unsigned int *pbufoutlen)
-{
-    assert(pc && pbufout && pbufoutlen);
-    if(!pbufout || !pbufoutlen)
-        return 1;
+    while(put < len)
+    {
+        size_t n;
 
-    pc->cache = (unsigned char*)malloc(cache_size);
-    pc->cache_len = cache_size;
-    pc->cache_cur = 0;
-    pc->pbufout = pbufout;
-    *pbufout = NULL;
-    pc->pbufoutlen = pbufoutlen;
-    *pbufoutlen = 0;
+        /* Wait for the writer to free a buffer to start on. */
+        if(r->pos == 0)
+        {
+            int failed;
+
+            pthread_mutex_lock(&r->lock);
+            while(!r->failed && r->filled - r->emptied == PIPE_BUFFERS)
+                pthread_cond_wait(&r->cond, &r->lock);
+            failed = r->failed;
+            pthread_mutex_unlock(&r->lock);
+            if(failed)
+                break;
+        }
+
+        n = PIPE_CHUNK - r->pos < len - put ? PIPE_CHUNK - r->pos
+                                             : len - put;
+        memcpy(r->bufs[r->filled % PIPE_BUFFERS] + r->pos, buf + put, n);
+        r->pos += n;
+        put += n;
+
+        if(r->pos == PIPE_CHUNK)
+            push_buffer(r);
+    }
 
-    return pc->cache ? 0 : 1;
+    return put;
 }
 
-static void free_cache(buf_cache* pc)
+static void
+free_ring(io_ring *r)
 {
-    assert(pc);
-    if(pc->cache)
+    unsigned int i;
+
+    if(r->ready)
     {
-        free(pc->cache);
-        pc->cache = NULL;
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
     }
+    for(i = 0; i < PIPE_BUFFERS; ++i)
+        free(r->bufs[i]);
 }
 
-static int flush_cache(buf_cache* pc)
+/*
+ * start_ring sets up a cleared ring on file and starts its thread.
+ */
+static int
+start_ring(io_ring *r, FILE *file, void *(*fn)(void*))
 {
-    assert(pc);
+    unsigned int i;
 
-    if(pc->cache_cur > 0)
+    r->file = file;
+    r->stats = cur_stats;
+    for(i = 0; i < PIPE_BUFFERS; ++i)
     {
-        unsigned int newlen = pc->cache_cur + *pc->pbufoutlen;
-        unsigned char* tmp = realloc(*pc->pbufout, newlen);
-        if(!tmp)
+        r->bufs[i] = (unsigned char*)counted_malloc(PIPE_CHUNK);
+        if(!r->bufs[i])
             return 1;
+    }
 
-        memcpy(tmp + *pc->pbufoutlen, pc->cache, pc->cache_cur);
-
-        *pc->pbufout = tmp;
-        *pc->pbufoutlen = newlen;
-        pc->cache_cur = 0;
+    if(pthread_mutex_init(&r->lock, NULL))
+        return 1;
+    if(pthread_cond_init(&r->cond, NULL))
+    {
+        pthread_mutex_destroy(&r->lock);
+        return 1;
     }
+    r->ready = 1;
 
-    return 0;
+    return pthread_create(&r->thread, NULL, fn, r) != 0;
 }
 
-static int write_cache(buf_cache* pc,
-                       const void *to_write,
-                       unsigned int to_write_len)
+/*
+ * start_pipeline starts the threads of a pipeline from in to out and
+ * points cur_pipe at it.
+ */
+static int
+start_pipeline(file_pipeline *p, FILE *in, FILE *out)
 {
-    unsigned char* tmp;
-
-    assert(pc && to_write);
-    assert(pc->cache_len >= pc->cache_cur);
+    memset(p, 0, sizeof(*p));
+    p->start = ftello(in);
 
-    if(to_write_len > pc->cache_len - pc->cache_cur)
+    if(start_ring(&p->in, in, reader_main))
     {
-        unsigned int newlen;
-        flush_cache(pc);
-        newlen = *pc->pbufoutlen + to_write_len;
-        tmp = realloc(*pc->pbufout, newlen);
-        if(!tmp)
-            return 1;
-        memcpy(tmp + *pc->pbufoutlen, to_write, to_write_len);
-        *pc->pbufout = tmp;
-        *pc->pbufoutlen = newlen;
+        free_ring(&p->in);
+        return 1;
     }
-    else
+
+    if(start_ring(&p->out, out, writer_main))
     {
-        memcpy(pc->cache + pc->cache_cur, to_write, to_write_len);
-        pc->cache_cur += to_write_len;
+        free_ring(&p->out);
+        pthread_mutex_lock(&p->in.lock);
+        p->in.stop = 1;
+        pthread_cond_signal(&p->in.cond);
+        pthread_mutex_unlock(&p->in.lock);
+        pthread_join(p->in.thread, NULL);
+        free_ring(&p->in);
+        return 1;
     }
 
+    cur_pipe = p;
     return 0;
 }
 
-static unsigned int
-get_symbol_frequencies(SymbolFrequencies pSF, FILE *in)
+/*
+ * finish_pipeline writes out what is left in the output ring, stops
+ * both threads and leaves a seekable input just after the bytes that
+ * were used. Returns non-zero if writing or seeking failed.
+ */
+static int
+finish_pipeline(file_pipeline *p)
 {
-    int c;
-    unsigned int total_count = 0;
-
-    init_frequencies(pSF);
-
-    while((c = fgetc(in)) != EOF)
-    {
-        unsigned char uc = c;
-        if(!pSF[uc])
-            pSF[uc] = new_leaf_node(uc);
-        ++(pSF[uc]->count);
-        ++total_count;
-    }
+    int rc;
 
-    return total_count;
+    cur_pipe = NULL;
+
+    if(p->out.pos > 0)
+        push_buffer(&p->out);
+    pthread_mutex_lock(&p->out.lock);
+    p->out.closed = 1;
+    pthread_cond_signal(&p->out.cond);
+    pthread_mutex_unlock(&p->out.lock);
+    pthread_join(p->out.thread, NULL);
+
+    pthread_mutex_lock(&p->in.lock);
+    p->in.stop = 1;
+    pthread_cond_signal(&p->in.cond);
+    pthread_mutex_unlock(&p->in.lock);
+    pthread_join(p->in.thread, NULL);
+
+    rc = p->out.failed;
+    if(p->start >= 0 && p->in.got > p->in.used
+       && fseeko(p->in.file, p->start + (off_t)p->in.used, SEEK_SET))
+        rc = 1;
+
+    free_ring(&p->in);
+    free_ring(&p->out);
+    return rc;
 }
 
-static unsigned int
-get_symbol_frequencies_from_memory(SymbolFrequencies pSF,
-                                   const unsigned char *bufin,
-                                   unsigned int bufinlen)
+/*
+ * read_input and write_output read and write bytes, through the
+ * pipeline of the call if it has one for the file.
+ */
+static size_t
+read_input(void *buf, size_t len, FILE *in)
 {
-    unsigned int i;
-    unsigned int total_count = 0;
+    if(cur_pipe && in == cur_pipe->in.file)
+        return ring_read(&cur_pipe->in, (unsigned char*)buf, len);
+    return timed_read(buf, len, in);
+}
 
-    init_frequencies(pSF);
+static size_t
+write_output(const void *buf, size_t len, FILE *out)
+{
+    if(cur_pipe && out == cur_pipe->out.file)
+        return ring_write(&cur_pipe->out, (const unsigned char*)buf, len);
+    return timed_write(buf, len, out);
+}
 
-    for(i = 0; i < bufinlen; ++i)
-    {
-        unsigned char uc = bufin[i];
-        if(!pSF[uc])
-            pSF[uc] = new_leaf_node(uc);
-        ++(pSF[uc]->count);
-        ++total_count;
-    }
+/*
+ * read_byte is fgetc through read_input.
+ */
+static int
+read_byte(FILE *in)
+{
+    unsigned char c;
 
-    return total_count;
+    return read_input(&c, 1, in) == 1 ? c : EOF;
 }
 
+/*
+ * start_stats starts keeping stats in stats for a call, storing the
+ * time it started in *pstart, unless stats is NULL or a call further
+ * up keeps them already. Returns non-zero if it did.
+ */
 static int
-SFComp(const void *p1, const void *p2)
+start_stats(huffman_stats *stats, double *pstart)
 {
-    const huffman_node *hn1 = *(const huffman_node**)p1;
-    const huffman_node *hn2 = *(const huffman_node**)p2;
-
-    /* Sort all NULLs to the end. */
-    if(hn1 == NULL && hn2 == NULL)
+    if(!stats || cur_stats)
         return 0;
-    if(hn1 == NULL)
-        return 1;
-    if(hn2 == NULL)
-        return -1;
 
-    if(hn1->count > hn2->count)
-        return 1;
-    else if(hn1->count < hn2->count)
-        return -1;
-
-    return 0;
+    memset(stats, 0, sizeof(*stats));
+    cur_stats = stats;
+    *pstart = stats_clock();
+    return 1;
 }
 
-/*
- * build_symbol_encoder builds a SymbolEncoder by walking
- */
 static void
-build_symbol_encoder(huffman_node *subtree, SymbolEncoder *pSF)
+finish_stats(int started, double start)
 {
-    if(subtree == NULL)
+    if(!started)
         return;
 
-    if(subtree->isLeaf)
-        (*pSF)[subtree->symbol] = new_code(subtree);
-    else
-    {
-        build_symbol_encoder(subtree->zero, pSF);
-        build_symbol_encoder(subtree->one, pSF);
-    }
+    cur_stats->seconds = stats_clock() - start;
+    cur_stats = NULL;
 }
 
 /*
- * calculate_huffman_codes turns pSF
+ * A code in stream order, first bit in bit 0, and its length. The
+ * encoder keeps one per symbol in a flat table.
  */
-static SymbolEncoder*
-calculate_huffman_codes(SymbolFrequencies pSF)
+typedef struct huffman_codeword_tag
 {
-    unsigned int i = 0;
-    unsigned int n = 0;
-    huffman_node *m1 = NULL, *m2 = NULL;
-    SymbolEncoder *pSE = NULL;
+    uint64_t code;
+    unsigned int len;
+} huffman_codeword;
 
-    /* Sort the symbol frequency array by ascending frequency. */
-    qsort(pSF, MAX_SYMBOLS, sizeof(pSF[0]), SFComp);
+static unsigned long
+numbytes_from_numbits(unsigned long numbits)
+{
+    return numbits / 8 + (numbits % 8 ? 1 : 0);
+}
 
-    /* Get the number of symbols. */
-    for(n = 0; n < MAX_SYMBOLS && pSF[n]; ++n)
-        ;
+/*
+ * get_bit returns the ith bit in the bits array
+ * in the 0th position of the return value.
+ */
+static unsigned char
+get_bit(const unsigned char* bits, unsigned long i)
+{
+    return (bits[i / 8] >> i % 8) & 1;
+}
 
-    for(i = 1; i < n; ++i)
-    {
-        /* Set m1 and m2 to the two subsets of least probability. */
-        m1 = pSF[0];
-        m2 = pSF[1];
+#define MAX_SYMBOLS 256
+
+/*
+ * Version 1 code tables are read into a tree whose nodes live in one
+ * array and name their children by 16-bit index. Node 0 is the root,
+ * which is never a child, so index 0 also means no child. A complete
+ * code over 256 symbols has at most 511 nodes; a table that needs more
+ * isn't a Huffman code and is rejected.
+ */
+#define MAX_TREE_NODES (2 * MAX_SYMBOLS - 1)
 
-        /* Replace m1 and m2 with a set {m1, m2} whose probability
-         * is the sum of that of m1 and m2. */
-        pSF[0] = m1->parent = m2->parent =
-                                  new_nonleaf_node(m1->count + m2->count, m1, m2);
-        pSF[1] = NULL;
+typedef struct huffman_node_tag
+{
+    uint16_t child[2];
+    unsigned char isLeaf;
+    unsigned char symbol;
+} huffman_node;
 
-        /* Put newSet into the correct count position in pSF. */
-        qsort(pSF, n, sizeof(pSF[0]), SFComp);
-    }
+typedef struct huffman_tree_tag
+{
+    huffman_node nodes[MAX_TREE_NODES];
+    unsigned int count;
+} huffman_tree;
 
-    /* Build the SymbolEncoder array from the tree. */
-    pSE = (SymbolEncoder*)malloc(sizeof(SymbolEncoder));
-    memset(pSE, 0, sizeof(SymbolEncoder));
-    build_symbol_encoder(pSF[0], pSE);
-    return pSE;
+static void
+init_tree(huffman_tree *t)
+{
+    memset(&t->nodes[0], 0, sizeof(t->nodes[0]));
+    t->count = 1;
 }
 
 /*
- * Write the huffman code table.
+ * add_tree_code adds the numbits long code in bits for symbol to t,
+ * failing if it runs into a code already there or t is full.
  */
 static int
-write_code_table(FILE* out, SymbolEncoder *se, uint32_t symbol_count)
+add_tree_code(huffman_tree *t,
+              unsigned char symbol,
+              const unsigned char *bits,
+              unsigned int numbits)
 {
-    uint32_t i, count = 0;
+    unsigned int curbit, p = 0;
 
-    /* Determine the number of entries in se. */
-    for(i = 0; i < MAX_SYMBOLS; ++i)
+    for(curbit = 0; curbit < numbits; ++curbit)
     {
-        if((*se)[i])
-            ++count;
-    }
+        huffman_node *n = &t->nodes[p];
+        unsigned int b = get_bit(bits, curbit);
 
-    /* Write the number of entries in network byte order. */
-    i = htonl(count);
-    if(fwrite(&i, sizeof(i), 1, out) != 1)
-        return 1;
-
-    /* Write the number of bytes that will be encoded. */
-    symbol_count = htonl(symbol_count);
-    if(fwrite(&symbol_count, sizeof(symbol_count), 1, out) != 1)
-        return 1;
+        if(n->isLeaf || (n->child[b] && curbit == numbits - 1))
+            return 1;
 
-    /* Write the entries. */
-    for(i = 0; i < MAX_SYMBOLS; ++i)
-    {
-        huffman_code *p = (*se)[i];
-        if(p)
+        if(n->child[b] == 0)
         {
-            unsigned int numbytes;
-            fputc((unsigned char)i, out);
-            fputc(p->numbits, out);
-            numbytes = numbytes_from_numbits(p->numbits);
-            if(fwrite(p->bits, 1, numbytes, out) != numbytes)
+            huffman_node *c;
+
+            if(t->count == MAX_TREE_NODES)
                 return 1;
+            n->child[b] = (uint16_t)t->count;
+            c = &t->nodes[t->count++];
+            c->child[0] = c->child[1] = 0;
+            c->isLeaf = curbit == numbits - 1;
+            c->symbol = symbol;
         }
+        p = n->child[b];
     }
 
     return 0;
 }
 
 /*
- * Allocates memory and sets *pbufout to point to it. The memory
- * contains the code table.
+ * buf_cache builds the output of the memory encoder in place. It grows
+ * geometrically, so building n bytes costs O(n) copying in all, and
+ * flush_cache trims it to size at the end.
  */
-static int
-write_code_table_to_memory(buf_cache *pc,
-                           SymbolEncoder *se,
-                           uint32_t symbol_count)
+typedef struct buf_cache_tag
 {
-    uint32_t i, count = 0;
-
-    /* Determine the number of entries in se. */
-    for(i = 0; i < MAX_SYMBOLS; ++i)
-    {
-        if((*se)[i])
-            ++count;
-    }
-
-    /* Write the number of entries in network byte order. */
-    i = htonl(count);
-
-    if(write_cache(pc, &i, sizeof(i)))
-        return 1;
+    unsigned char **pbufout;
+    size_t *pbufoutlen;
+    size_t capacity;
+} buf_cache;
 
-    /* Write the number of bytes that will be encoded. */
-    symbol_count = htonl(symbol_count);
-    if(write_cache(pc, &symbol_count, sizeof(symbol_count)))
+static int init_cache(buf_cache* pc,
+                      size_t cache_size,
+                      unsigned char **pbufout,
+                      size_t *pbufoutlen)
+{
+    assert(pc && pbufout && pbufoutlen);
+    if(!pbufout || !pbufoutlen)
         return 1;
 
-    /* Write the entries. */
-    for(i = 0; i < MAX_SYMBOLS; ++i)
-    {
-        huffman_code *p = (*se)[i];
-        if(p)
-        {
-            unsigned int numbytes;
-            /* The value of i is < MAX_SYMBOLS (256), so it can
-            be stored in an unsigned char. */
-            unsigned char uc = (unsigned char)i;
-            /* Write the 1 byte symbol. */
-            if(write_cache(pc, &uc, sizeof(uc)))
-                return 1;
-            /* Write the 1 byte code bit length. */
-            uc = (unsigned char)p->numbits;
-            if(write_cache(pc, &uc, sizeof(uc)))
-                return 1;
-            /* Write the code bytes. */
-            numbytes = numbytes_from_numbits(p->numbits);
-            if(write_cache(pc, p->bits, numbytes))
-                return 1;
-        }
-    }
+    pc->pbufout = pbufout;
+    *pbufout = (unsigned char*)counted_malloc(cache_size);
+    pc->pbufoutlen = pbufoutlen;
+    *pbufoutlen = 0;
+    pc->capacity = cache_size;
 
-    return 0;
+    return *pbufout ? 0 : 1;
 }
 
 /*
- * read_code_table builds a Huffman tree
+ * free_cache drops what was built, for when encoding fails.
  */
-static bool
-read_code_table(FILE* in, huffman_node** rootOut, unsigned int *dataBytesOut)
+static void free_cache(buf_cache* pc)
 {
-    huffman_node *root = NULL;
-    uint32_t count = 0;
-
-    if(fread(&count, sizeof(count), 1, in) != 1)
-    {
-        return false;
-    }
+    assert(pc);
+    free(*pc->pbufout);
+    *pc->pbufout = NULL;
+    *pc->pbufoutlen = 0;
+}
 
-    count = ntohl(count);
+static int flush_cache(buf_cache* pc)
+{
+    unsigned char* tmp;
+
+    assert(pc);
+    tmp = counted_realloc(*pc->pbufout, *pc->pbufoutlen ? *pc->pbufoutlen : 1);
+    if(!tmp)
+        return 1;
+
+    *pc->pbufout = tmp;
+    pc->capacity = *pc->pbufoutlen;
+    return 0;
+}
+
+/*
+ * reserve_cache extends the output by len bytes, returning a pointer
+ * to them so they can be written in place.
+ */
+static unsigned char*
+reserve_cache(buf_cache* pc, uint64_t len)
+{
+    size_t used = *pc->pbufoutlen;
+
+    if(len > SIZE_MAX - used)
+        return NULL;
+
+    if(used + len > pc->capacity)
+    {
+        size_t newcap = pc->capacity <= SIZE_MAX / 2
+                        ? 2 * pc->capacity : SIZE_MAX;
+        unsigned char* tmp;
+
+        if(newcap < used + len)
+            newcap = used + (size_t)len;
+        tmp = counted_realloc(*pc->pbufout, newcap);
+        if(!tmp)
+            return NULL;
+        *pc->pbufout = tmp;
+        pc->capacity = newcap;
+    }
+
+    *pc->pbufoutlen = used + (size_t)len;
+    return *pc->pbufout + used;
+}
+
+/*
+ * unreserve_cache gives back the last len bytes of the output.
+ */
+static void
+unreserve_cache(buf_cache* pc, size_t len)
+{
+    assert(pc && len <= *pc->pbufoutlen);
+    *pc->pbufoutlen -= len;
+}
+
+static int write_cache(buf_cache* pc,
+                       const void *to_write,
+                       size_t to_write_len)
+{
+    unsigned char* dst;
+
+    assert(pc && to_write);
+
+    dst = reserve_cache(pc, to_write_len);
+    if(!dst)
+        return 1;
+
+    memcpy(dst, to_write, to_write_len);
+    return 0;
+}
+
+/*
+ * Byte histograms.
+ *
+ * Counting straight into one table stalls on skewed input, where the
+ * same counter is loaded right after it was stored. Spreading
+ * consecutive bytes over several sub-histograms, which are summed at
+ * the end, lets those increments overlap. The sub-histograms use 32-bit
+ * counters, so the input is counted in slices small enough that none
+ * can overflow.
+ */
+#define HIST_WAYS 4
+#define HIST_SLICE ((size_t)1 << 30)
+#define HIST_DIRECT 1024
+
+/*
+ * count_word adds the eight bytes of w to the sub-histograms.
+ */
+static inline void
+count_word(uint64_t w, uint32_t hist[][MAX_SYMBOLS])
+{
+    ++hist[0][w & 0xFF];
+    ++hist[1][(w >> 8) & 0xFF];
+    ++hist[2][(w >> 16) & 0xFF];
+    ++hist[3][(w >> 24) & 0xFF];
+    ++hist[0][(w >> 32) & 0xFF];
+    ++hist[1][(w >> 40) & 0xFF];
+    ++hist[2][(w >> 48) & 0xFF];
+    ++hist[3][w >> 56];
+}
+
+typedef void count_bytes_fn(const unsigned char *in,
+                            size_t len,
+                            uint32_t hist[][MAX_SYMBOLS]);
+
+static void
+count_bytes_portable(const unsigned char *in,
+                     size_t len,
+                     uint32_t hist[][MAX_SYMBOLS])
+{
+    size_t i = 0;
+
+    for(; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+
+        /* Byte order doesn't matter here; every byte gets counted. */
+        memcpy(&w, in + i, sizeof(w));
+        count_word(w, hist);
+    }
+
+    for(; i < len; ++i)
+        ++hist[i % HIST_WAYS][in[i]];
+}
+
+#if HUFFMAN_DISPATCH
+/*
+ * count_bytes_avx2 checks 32 bytes at a time for a run of one value,
+ * the worst case for the counters, and counts such a run with a
+ * single add; anything else is counted a word at a time.
+ */
+static void TARGET("avx2")
+count_bytes_avx2(const unsigned char *in,
+                 size_t len,
+                 uint32_t hist[][MAX_SYMBOLS])
+{
+    size_t i = 0;
+
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i first = _mm256_set1_epi8((char)in[i]);
+        uint64_t w[4];
+
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first)) == -1)
+        {
+            hist[0][in[i]] += 32;
+            continue;
+        }
+
+        memcpy(w, in + i, sizeof(w));
+        count_word(w[0], hist);
+        count_word(w[1], hist);
+        count_word(w[2], hist);
+        count_word(w[3], hist);
+    }
+
+    count_bytes_portable(in + i, len - i, hist);
+}
+#endif
+
+static count_bytes_fn *count_bytes = count_bytes_portable;
+
+/*
+ * count_symbols stores in counts how often each byte value occurs in
+ * the len bytes at in.
+ */
+static void
+count_symbols(const unsigned char *in, size_t len, uint64_t *counts)
+{
+    uint32_t hist[HIST_WAYS][MAX_SYMBOLS];
+    size_t done, i, k;
+
+    memset(counts, 0, MAX_SYMBOLS * sizeof(*counts));
+
+    /* Short messages are counted directly; clearing and folding the
+       sub-histograms would cost more than the counting. */
+    if(len < HIST_DIRECT)
+    {
+        for(i = 0; i < len; ++i)
+            ++counts[in[i]];
+        return;
+    }
+
+    for(done = 0; done < len; done += HIST_SLICE)
+    {
+        size_t n = len - done < HIST_SLICE ? len - done : HIST_SLICE;
+
+        memset(hist, 0, sizeof(hist));
+        count_bytes(in + done, n, hist);
+        for(k = 0; k < sizeof(hist) / sizeof(hist[0]); ++k)
+            for(i = 0; i < MAX_SYMBOLS; ++i)
+                counts[i] += hist[k][i];
+    }
+}
+
+/*
+ * Code lengths are computed on flat arrays. The symbols that occur are
+ * sorted by count once, then the in-place method of Moffat and
+ * Katajainen turns the sorted counts into code lengths in three
+ * linear passes, with no tree built on the way.
+ */
+typedef struct symbol_count_tag
+{
+    uint64_t count;
+    unsigned int symbol;
+} symbol_count;
+
+static int
+symbol_count_cmp(const void *p1, const void *p2)
+{
+    const symbol_count *a = (const symbol_count*)p1;
+    const symbol_count *b = (const symbol_count*)p2;
+
+    if(a->count != b->count)
+        return a->count < b->count ? -1 : 1;
+    return a->symbol < b->symbol ? -1 : a->symbol > b->symbol;
+}
+
+/*
+ * minimum_redundancy replaces the n ascending weights in a with the
+ * code lengths of an optimal prefix code for them. The first pass
+ * merges weights, leaving parent positions behind; the second turns
+ * those into depths of the internal nodes and the third hands out
+ * leaf depths level by level.
+ */
+static void
+minimum_redundancy(uint64_t *a, size_t n)
+{
+    size_t root, leaf, next, avbl, used, dpth;
+
+    if(n == 0)
+        return;
+    if(n == 1)
+    {
+        a[0] = 0;
+        return;
+    }
+
+    a[0] += a[1];
+    root = 0;
+    leaf = 2;
+    for(next = 1; next < n - 1; ++next)
+    {
+        if(leaf >= n || a[root] < a[leaf])
+        {
+            a[next] = a[root];
+            a[root++] = next;
+        }
+        else
+        {
+            a[next] = a[leaf++];
+        }
+
+        if(leaf >= n || (root < next && a[root] < a[leaf]))
+        {
+            a[next] += a[root];
+            a[root++] = next;
+        }
+        else
+        {
+            a[next] += a[leaf++];
+        }
+    }
+
+    a[n - 2] = 0;
+    for(next = n - 2; next-- > 0;)
+        a[next] = a[a[next]] + 1;
+
+    avbl = 1;
+    used = dpth = 0;
+    root = n - 2;
+    next = n - 1;
+    for(;;)
+    {
+        while(root != (size_t)-1 && a[root] == dpth)
+        {
+            ++used;
+            --root;
+        }
+        while(avbl > used)
+        {
+            a[next--] = dpth;
+            --avbl;
+        }
+        if(used == 0)
+            break;
+        avbl = 2 * used;
+        ++dpth;
+        used = 0;
+    }
+}
+
+/*
+ * limit_code_lengths makes the n lengths in lens, which run from
+ * longest to shortest, no longer than maxbits. Overlong codes are cut
+ * to maxbits, which overfills the code space; each step then moves a
+ * code from maxbits up into the place of a shorter code, which is split
+ * in two, freeing one maxbits slot, until the Kraft sum is exact
+ * again. The lengths are handed back out in the same order, so the
+ * rarest symbols still get the longest codes.
+ */
+static void
+limit_code_lengths(uint64_t *lens, size_t n, unsigned int maxbits)
+{
+    uint64_t bl_count[HUFFMAN_MAX_CODE_LENGTH + 1];
+    uint64_t total = 0;
+    unsigned int len;
+    size_t i;
+
+    if(n < 2 || lens[0] <= maxbits)
+        return;
+
+    memset(bl_count, 0, sizeof(bl_count));
+    for(i = 0; i < n; ++i)
+        ++bl_count[lens[i] < maxbits ? lens[i] : maxbits];
+
+    for(len = 1; len <= maxbits; ++len)
+        total += bl_count[len] << (maxbits - len);
+
+    while(total > (uint64_t)1 << maxbits)
+    {
+        --bl_count[maxbits];
+        for(len = maxbits - 1; len > 0; --len)
+        {
+            if(bl_count[len])
+            {
+                --bl_count[len];
+                bl_count[len + 1] += 2;
+                break;
+            }
+        }
+        --total;
+    }
+
+    i = 0;
+    for(len = maxbits; len > 0; --len)
+        while(bl_count[len]--)
+            lens[i++] = len;
+}
+
+/*
+ * calculate_code_lengths stores in lens the Huffman code length of
+ * each symbol given its count, with no code longer than maxbits. A
+ * lone symbol gets a zero length code.
+ */
+static void
+calculate_code_lengths(const uint64_t *counts,
+                       unsigned int maxbits,
+                       unsigned char *lens)
+{
+    symbol_count syms[MAX_SYMBOLS];
+    uint64_t weights[MAX_SYMBOLS];
+    size_t i, n = 0;
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+    {
+        if(counts[i])
+        {
+            syms[n].count = counts[i];
+            syms[n].symbol = (unsigned int)i;
+            ++n;
+        }
+    }
+
+    qsort(syms, n, sizeof(syms[0]), symbol_count_cmp);
+    for(i = 0; i < n; ++i)
+        weights[i] = syms[i].count;
+
+    minimum_redundancy(weights, n);
+    limit_code_lengths(weights, n, maxbits);
+
+    memset(lens, 0, MAX_SYMBOLS);
+    for(i = 0; i < n; ++i)
+        lens[syms[i].symbol] = (unsigned char)weights[i];
+}
+
+/*
+ * read_code_table reads a version 1 code table, whose entry count has
+ * already been read, into t.
+ */
+static bool
+read_code_table(FILE* in,
+                uint32_t count,
+                huffman_tree *t,
+                unsigned int *dataBytesOut)
+{
+    unsigned char bytes[32];
+    unsigned int dataBytes = 0;
 
     if (count > MAX_SYMBOLS)
     {
         return false;
     }
 
-    unsigned int dataBytes = 0;
-    if(fread(&dataBytes, sizeof(dataBytes), 1, in) != 1)
+    if(read_input(&dataBytes, sizeof(dataBytes), in) != sizeof(dataBytes))
     {
         return false;
     }
@@ -526,464 +1081,5265 @@ read_code_table(FILE* in, huffman_node** rootOut, unsigned int *dataBytesOut)
         return false;
     }
 
+    init_tree(t);
+
     /* Read the entries. */
     while(count-- > 0)
     {
         int c = 0;
 
-        if((c = fgetc(in)) == EOF)
+        if((c = read_byte(in)) == EOF)
         {
-            free_huffman_tree(root);
             return false;
         }
         unsigned char symbol = (unsigned char)c;
 
-        if((c = fgetc(in)) == EOF)
+        if((c = read_byte(in)) == EOF)
         {
-            free_huffman_tree(root);
             return false;
         }
         unsigned char numbits = (unsigned char)c;
 
-        if (root == NULL)
+        if (numbits == 0)
         {
-            if (numbits == 0)
-            {
-                if (count != 0) {
-                    // Invalid code table. Abort processing.
-                    return false;
-                }
+            // Valid code tables only have 0 bit length codes if they encode only 1 symbol.
+            if (count != 0 || t->count != 1) {
+                return false;
+            }
+
+            t->nodes[0].isLeaf = 1;
+            t->nodes[0].symbol = symbol;
+            break;
+        }
+
+        unsigned char numbytes = (unsigned char)numbytes_from_numbits(numbits);
+        if(read_input(bytes, numbytes, in) != numbytes
+           || add_tree_code(t, symbol, bytes, numbits))
+        {
+            return false;
+        }
+    }
+
+    *dataBytesOut = dataBytes;
+    return true;
+}
+
+static int
+memread(const unsigned char* buf,
+        size_t buflen,
+        size_t *pindex,
+        void* bufout,
+        size_t readlen)
+{
+    assert(buf && pindex && bufout);
+    assert(buflen >= *pindex);
+    if(buflen < *pindex)
+        return 1;
+    if(readlen > buflen - *pindex)
+        return 1;
+    memcpy(bufout, buf + *pindex, readlen);
+    *pindex += readlen;
+    return 0;
+}
+
+static int
+read_code_table_from_memory(const unsigned char* bufin,
+                            size_t bufinlen,
+                            size_t *pindex,
+                            huffman_tree *t,
+                            uint32_t *pDataBytes)
+{
+    unsigned char bytes[32];
+    uint32_t count;
+
+    /* Read the number of entries.
+       (it is stored in network byte order). */
+    if(memread(bufin, bufinlen, pindex, &count, sizeof(count)))
+        return 1;
+
+    count = ntohl(count);
+
+    /* Read the number of data bytes this encoding represents. */
+    if(memread(bufin, bufinlen, pindex, pDataBytes, sizeof(*pDataBytes)))
+        return 1;
+
+    *pDataBytes = ntohl(*pDataBytes);
+
+    if(count > MAX_SYMBOLS || (count == 0 && *pDataBytes > 0))
+        return 1;
+
+    init_tree(t);
+
+    /* Read the entries. */
+    while(count-- > 0)
+    {
+        unsigned char symbol;
+        unsigned char numbits;
+
+        if(memread(bufin, bufinlen, pindex, &symbol, sizeof(symbol))
+           || memread(bufin, bufinlen, pindex, &numbits, sizeof(numbits)))
+            return 1;
+
+        if(numbits == 0)
+        {
+            /* A zero length code is only valid for a single symbol
+               table, where the data is a run of that symbol. */
+            if(count != 0 || t->count != 1)
+                return 1;
+            t->nodes[0].isLeaf = 1;
+            t->nodes[0].symbol = symbol;
+            return 0;
+        }
+
+        if(memread(bufin, bufinlen, pindex, bytes,
+                   numbytes_from_numbits(numbits))
+           || add_tree_code(t, symbol, bytes, numbits))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Table-driven decoding.
+ *
+ * Codes are written least significant bit first, so the next code in
+ * the stream always sits in the low bits of the bit buffer. The
+ * decoder peeks HUFFMAN_LOOKUP_BITS bits and resolves most symbols
+ * with a single lookup in the root table. Longer codes hit a link
+ * entry that names a second level table indexed by the bits that
+ * follow; links may chain for pathologically long codes.
+ */
+#define HUFFMAN_LOOKUP_BITS 11
+#define HUFFMAN_SUBTABLE_BITS 8
+#define HUFFMAN_MAX_CODE_BITS HUFFMAN_MAX_CODE_LENGTH
+
+typedef struct huffman_entry_tag
+{
+    /* The symbol, or the offset of the linked table. */
+    uint16_t value;
+    /* The number of bits this entry consumes. Zero marks a bit
+       pattern that no code starts with. */
+    unsigned char bits;
+    /* Zero for a symbol, else the index width of the linked table. */
+    unsigned char link;
+} huffman_entry;
+
+typedef struct huffman_decoder_tag
+{
+    huffman_entry *table;
+    unsigned int size;
+    unsigned int capacity;
+    unsigned int rootbits;
+    unsigned int maxlen;
+} huffman_decoder;
+
+static void
+init_decoder(huffman_decoder *d)
+{
+    memset(d, 0, sizeof(*d));
+}
+
+static void
+free_decoder(huffman_decoder *d)
+{
+    free(d->table);
+    d->table = NULL;
+    d->size = d->capacity = 0;
+}
+
+/*
+ * alloc_decode_table appends a zeroed table of 2^bits entries
+ * and returns its offset, or -1 on failure.
+ */
+static long
+alloc_decode_table(huffman_decoder *d, unsigned int bits)
+{
+    unsigned int offset = d->size;
+    unsigned int n = 1u << bits;
+
+    /* Link entries store the offset in 16 bits. */
+    if(offset + n > 0xFFFFu + 1)
+        return -1;
+
+    if(offset + n > d->capacity)
+    {
+        unsigned int newcap = d->capacity ? d->capacity : n;
+        huffman_entry *tmp;
+
+        while(newcap < offset + n)
+            newcap *= 2;
+        tmp = (huffman_entry*)counted_realloc(d->table, newcap * sizeof(*tmp));
+        if(!tmp)
+            return -1;
+        d->table = tmp;
+        d->capacity = newcap;
+    }
+
+    memset(d->table + offset, 0, n * sizeof(huffman_entry));
+    d->size = offset + n;
+    return offset;
+}
+
+/*
+ * fill_decode_table fills the table at offset, which is indexed by
+ * bits [consumed, consumed + bits) of each code, with the given
+ * symbols. Codes that do not end within the table get linked tables
+ * of their own. Returns non-zero if the codes are not prefix free or
+ * the tables can't be allocated.
+ */
+static int
+fill_decode_table(huffman_decoder *d,
+                  const uint64_t *codes,
+                  const unsigned char *lens,
+                  const unsigned char *syms,
+                  unsigned int nsyms,
+                  unsigned int consumed,
+                  unsigned int bits,
+                  unsigned int offset)
+{
+    unsigned int size = 1u << bits;
+    unsigned int i, j;
+
+    /* Codes that end within this table fill every slot whose low
+       bits match them. */
+    for(i = 0; i < nsyms; ++i)
+    {
+        unsigned char s = syms[i];
+        unsigned int rem = lens[s] - consumed;
+        unsigned int idx = (unsigned int)(codes[s] >> consumed);
+
+        if(rem > bits)
+            continue;
+
+        for(j = idx; j < size; j += 1u << rem)
+        {
+            huffman_entry *e = &d->table[offset + j];
+            if(e->bits)
+                return 1;
+            e->value = s;
+            e->bits = (unsigned char)rem;
+        }
+    }
+
+    /* Longer codes are grouped by the slot they pass through. */
+    for(i = 0; i < nsyms; ++i)
+    {
+        unsigned char sub[MAX_SYMBOLS];
+        unsigned int nsub = 0, maxrem = 0;
+        unsigned int idx, subbits, k;
+        long suboffset;
+        huffman_entry *e;
+
+        if(lens[syms[i]] - consumed <= bits)
+            continue;
+
+        idx = (unsigned int)(codes[syms[i]] >> consumed) & (size - 1);
+        e = &d->table[offset + idx];
+        if(e->link)
+            continue;
+        if(e->bits)
+            return 1;
+
+        for(k = i; k < nsyms; ++k)
+        {
+            unsigned char s = syms[k];
+            if(lens[s] - consumed > bits
+               && ((unsigned int)(codes[s] >> consumed) & (size - 1)) == idx)
+            {
+                sub[nsub++] = s;
+                if(lens[s] - consumed - bits > maxrem)
+                    maxrem = lens[s] - consumed - bits;
+            }
+        }
+
+        subbits = maxrem < HUFFMAN_SUBTABLE_BITS
+                  ? maxrem : HUFFMAN_SUBTABLE_BITS;
+        suboffset = alloc_decode_table(d, subbits);
+        if(suboffset < 0)
+            return 1;
+
+        e = &d->table[offset + idx];
+        e->value = (uint16_t)suboffset;
+        e->bits = (unsigned char)bits;
+        e->link = (unsigned char)subbits;
+
+        if(fill_decode_table(d, codes, lens, sub, nsub,
+                             consumed + bits, subbits,
+                             (unsigned int)suboffset))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * build_decoder builds the lookup tables for a set of codes into d,
+ * which must have been initialised with init_decoder.
+ * codes[s] holds the code of symbol s in stream order (first bit in
+ * bit 0) and lens[s] its length; symbols with a zero length are
+ * unused.
+ */
+static int
+build_decoder(huffman_decoder *d,
+              const uint64_t *codes,
+              const unsigned char *lens)
+{
+    unsigned char syms[MAX_SYMBOLS];
+    unsigned int nsyms = 0, maxlen = 0;
+    unsigned int i;
+
+    /* Table storage from an earlier build is reused. */
+    d->size = 0;
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+    {
+        if(lens[i] == 0)
+            continue;
+        if(lens[i] > HUFFMAN_MAX_CODE_BITS)
+            return 1;
+        syms[nsyms++] = (unsigned char)i;
+        if(lens[i] > maxlen)
+            maxlen = lens[i];
+    }
+
+    if(nsyms == 0)
+        return 1;
+
+    d->maxlen = maxlen;
+    d->rootbits = maxlen < HUFFMAN_LOOKUP_BITS ? maxlen : HUFFMAN_LOOKUP_BITS;
+    if(alloc_decode_table(d, d->rootbits) < 0
+       || fill_decode_table(d, codes, lens, syms, nsyms, 0, d->rootbits, 0))
+    {
+        free_decoder(d);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+collect_tree_codes(const huffman_tree *t,
+                   unsigned int node,
+                   uint64_t code,
+                   unsigned int depth,
+                   uint64_t *codes,
+                   unsigned char *lens,
+                   int *toolong)
+{
+    const huffman_node *n = &t->nodes[node];
+
+    if(n->isLeaf)
+    {
+        codes[n->symbol] = code;
+        lens[n->symbol] = (unsigned char)depth;
+    }
+    else if(depth >= HUFFMAN_MAX_CODE_BITS)
+    {
+        *toolong = 1;
+    }
+    else
+    {
+        if(n->child[0])
+            collect_tree_codes(t, n->child[0], code, depth + 1,
+                               codes, lens, toolong);
+        if(n->child[1])
+            collect_tree_codes(t, n->child[1], code | (uint64_t)1 << depth,
+                               depth + 1, codes, lens, toolong);
+    }
+}
+
+/*
+ * build_decoder_from_tree builds the lookup tables for the codes of
+ * a Huffman tree read from a code table.
+ */
+static int
+build_decoder_from_tree(huffman_decoder *d, const huffman_tree *t)
+{
+    uint64_t codes[MAX_SYMBOLS];
+    unsigned char lens[MAX_SYMBOLS];
+    int toolong = 0;
+
+    memset(codes, 0, sizeof(codes));
+    memset(lens, 0, sizeof(lens));
+    collect_tree_codes(t, 0, 0, 0, codes, lens, &toolong);
+    if(toolong)
+        return 1;
+
+    return build_decoder(d, codes, lens);
+}
+
+typedef struct bit_reader_tag
+{
+    const unsigned char *cur;
+    const unsigned char *end;
+    uint64_t bitbuf;
+    unsigned int bitcount;
+    /* Set once end is the true end of the input. */
+    int final;
+} bit_reader;
+
+KERNEL_BODY uint64_t
+load_le64(const unsigned char *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8
+           | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+           | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40
+           | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static void
+init_bit_reader(bit_reader *br,
+                const unsigned char *buf,
+                size_t len,
+                int final)
+{
+    br->cur = buf;
+    br->end = buf + len;
+    br->bitbuf = 0;
+    br->bitcount = 0;
+    br->final = final;
+}
+
+/*
+ * decode_symbols decodes up to count symbols into out and stores the
+ * number decoded in *pdone. Unless the reader is final, it stops early
+ * once fewer than 8 input bytes remain so the caller can append more.
+ * Returns non-zero on an invalid code or truncated input.
+ */
+typedef int decode_symbols_fn(const huffman_decoder *d,
+                              bit_reader *br,
+                              unsigned char *out,
+                              size_t count,
+                              size_t *pdone);
+
+KERNEL_BODY int
+decode_symbols_body(const huffman_decoder *d,
+                    bit_reader *br,
+                    unsigned char *out,
+                    size_t count,
+                    size_t *pdone)
+{
+    const huffman_entry *table = d->table;
+    uint64_t rootmask = ((uint64_t)1 << d->rootbits) - 1;
+    uint64_t bitbuf = br->bitbuf;
+    unsigned int bitcount = br->bitcount;
+    const unsigned char *cur = br->cur;
+    size_t i = 0;
+    int rc = 0;
+
+    /* When every code fits the root table, as with length-limited
+       codes, one refill covers a fixed number of symbols, and each
+       takes a single lookup. */
+    if(d->size == 1u << d->rootbits)
+    {
+        unsigned int group = 56 / d->rootbits, k;
+
+        while(count - i >= group && br->end - cur >= 8)
+        {
+            bitbuf |= load_le64(cur) << bitcount;
+            cur += (63 - bitcount) >> 3;
+            bitcount |= 56;
+
+            for(k = 0; k < group; ++k)
+            {
+                const huffman_entry *e = &table[bitbuf & rootmask];
+
+                if(e->bits == 0)
+                {
+                    rc = 1;
+                    break;
+                }
+                out[i++] = (unsigned char)e->value;
+                bitbuf >>= e->bits;
+                bitcount -= e->bits;
+            }
+            if(rc)
+                break;
+        }
+    }
+
+    for(; rc == 0 && i < count; ++i)
+    {
+        const huffman_entry *e;
+        uint64_t peek;
+        unsigned int n = 0;
+
+        if(br->end - cur >= 8)
+        {
+            /* Top the buffer up to at least 56 bits. Bytes only
+               partially loaded are loaded again by the next refill. */
+            bitbuf |= load_le64(cur) << bitcount;
+            cur += (63 - bitcount) >> 3;
+            bitcount |= 56;
+        }
+        else if(!br->final)
+        {
+            break;
+        }
+        else
+        {
+            while(bitcount <= 56 && cur < br->end)
+            {
+                bitbuf |= (uint64_t)*cur++ << bitcount;
+                bitcount += 8;
+            }
+        }
+
+        peek = bitbuf;
+        e = &table[peek & rootmask];
+        while(e->link)
+        {
+            unsigned int link = e->link;
+            n += e->bits;
+            peek >>= e->bits;
+            e = &table[e->value + (peek & ((1u << link) - 1))];
+        }
+        n += e->bits;
+
+        if(e->bits == 0 || n > bitcount)
+        {
+            rc = 1;
+            break;
+        }
+
+        out[i] = (unsigned char)e->value;
+        bitbuf >>= n;
+        bitcount -= n;
+    }
+
+    br->bitbuf = bitbuf;
+    br->bitcount = bitcount;
+    br->cur = cur;
+    *pdone = i;
+    return rc;
+}
+
+static int
+decode_symbols_portable(const huffman_decoder *d,
+                        bit_reader *br,
+                        unsigned char *out,
+                        size_t count,
+                        size_t *pdone)
+{
+    return decode_symbols_body(d, br, out, count, pdone);
+}
+
+#if HUFFMAN_DISPATCH
+/* BMI2 shifts by a register without tying up CL. */
+static int TARGET("bmi2")
+decode_symbols_bmi2(const huffman_decoder *d,
+                    bit_reader *br,
+                    unsigned char *out,
+                    size_t count,
+                    size_t *pdone)
+{
+    return decode_symbols_body(d, br, out, count, pdone);
+}
+#endif
+
+static decode_symbols_fn *decode_symbols = decode_symbols_portable;
+
+/*
+ * Format version 2.
+ *
+ * A version 2 stream is the magic "HUF" and a version byte, then a
+ * sequence of blocks terminated by a HUFFMAN_BLOCK_END byte. Each
+ * block is
+ *
+ *   type     1 byte, HUFFMAN_BLOCK_HUFFMAN
+ *   rawlen   varint, the number of decoded bytes
+ *   paylen   varint, the number of bytes that follow in this block
+ *   lengths  the packed code lengths, see pack_code_lengths
+ *   bits     the canonical codes, first bit in the low bit of a byte
+ *
+ * A block of type HUFFMAN_BLOCK_STREAMS splits its symbols over four
+ * bit streams, so a decoder can follow all four at once instead of
+ * waiting on one long chain of lookups. The first three streams hold
+ * a quarter of the symbols each, rounded up, and the last the rest.
+ * Such a block holds at most HUFFMAN_BLOCK_SIZE bytes, and its code
+ * lengths are followed by
+ *
+ *   sizes    three varints, the byte sizes of the first three streams
+ *   streams  the four streams back to back, each padded to a byte
+ *
+ * Data that codes no smaller than it is goes in a block of type
+ * HUFFMAN_BLOCK_STORED, whose payload is the rawlen bytes themselves,
+ * and a block of one repeated byte in a HUFFMAN_BLOCK_RUN block, whose
+ * payload is that byte. Both decode at memcpy and memset speed. A
+ * stored block holds at most HUFFMAN_BLOCK_SIZE bytes.
+ *
+ * Varints hold 7 bits per byte, low bits first, with the high bit set
+ * on every byte but the last.
+ *
+ * Encoders cut their input into blocks of HUFFMAN_BLOCK_SIZE bytes and
+ * build a table per block, so a stream can be written in one pass
+ * with bounded memory and a decoder never needs more than one block's
+ * table at a time.
+ *
+ * Only code lengths are stored; both sides derive the same canonical
+ * codes from them. A table with a single symbol has no code bits and
+ * stands for a run of that symbol, though encoders write a run block
+ * for one instead.
+ *
+ * A stream of more than one block ends with an index instead of the
+ * end byte, so readers with random access can find every block
+ * without scanning the stream:
+ *
+ *   type     1 byte, HUFFMAN_BLOCK_INDEX
+ *   count    varint, the number of blocks
+ *   entries  count pairs of varints: the block's size including its
+ *            header, and its decoded length
+ *   indexlen 8 bytes, little endian, the size of the index up to here
+ *   magic    "HUFX"
+ *
+ * Block offsets in the stream and in the decoded data are the running
+ * sums of the sizes, starting after the magic and at zero.
+ *
+ * Version 1 streams have no magic. They start with the big endian
+ * number of code table entries, which is at most MAX_SYMBOLS, so their
+ * first byte is always zero.
+ */
+#define HUFFMAN_MAGIC_LEN 4
+#define HUFFMAN_BLOCK_END 0
+#define HUFFMAN_BLOCK_HUFFMAN 1
+#define HUFFMAN_BLOCK_INDEX 2
+#define HUFFMAN_BLOCK_STREAMS 3
+#define HUFFMAN_BLOCK_STORED 4
+#define HUFFMAN_BLOCK_RUN 5
+#define HUFFMAN_TRAILER_LEN 12
+#define HUFFMAN_STREAMS 4
+#define MAX_VARINT_LEN 10
+#define MAX_STREAM_SIZES ((HUFFMAN_STREAMS - 1) * MAX_VARINT_LEN)
+#define MAX_BLOCK_HEADER (1 + 2 * MAX_VARINT_LEN + MAX_SYMBOLS \
+                          + MAX_STREAM_SIZES)
+#define HUFFMAN_BLOCK_SIZE (256 * 1024)
+
+/*
+ * Shorter blocks are left as one stream, as splitting them gains less
+ * than the stream sizes cost. The codes of a block never take more
+ * than 8 bits a symbol, so its streams take at most a byte more each.
+ */
+#define HUFFMAN_STREAMS_MIN 4096
+#define MAX_STREAMS_PAYLOAD (MAX_SYMBOLS + MAX_STREAM_SIZES \
+                             + HUFFMAN_BLOCK_SIZE + HUFFMAN_STREAMS)
+
+static const unsigned char huffman_magic[HUFFMAN_MAGIC_LEN] =
+{
+    'H', 'U', 'F', 2
+};
+
+static const unsigned char huffman_index_magic[HUFFMAN_MAGIC_LEN] =
+{
+    'H', 'U', 'F', 'X'
+};
+
+static unsigned int
+put_varint(unsigned char *p, uint64_t v)
+{
+    unsigned int n = 0;
+
+    while(v >= 0x80)
+    {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static unsigned int
+varint_len(uint64_t v)
+{
+    unsigned int n = 1;
+
+    while(v >= 0x80)
+    {
+        v >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+static int
+get_varint(const unsigned char *buf,
+           size_t buflen,
+           size_t *pindex,
+           uint64_t *pv)
+{
+    uint64_t v = 0;
+    unsigned int shift;
+
+    for(shift = 0; shift < 64 && *pindex < buflen; shift += 7)
+    {
+        unsigned char b = buf[(*pindex)++];
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if(!(b & 0x80))
+        {
+            *pv = v;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int
+fget_varint(FILE *in, uint64_t *pv)
+{
+    uint64_t v = 0;
+    unsigned int shift;
+    int c;
+
+    for(shift = 0; shift < 64 && (c = read_byte(in)) != EOF; shift += 7)
+    {
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if(!(c & 0x80))
+        {
+            *pv = v;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * assign_canonical_codes assigns canonical codes to the code lengths
+ * in lens. Shorter codes come first and codes of equal length are in
+ * symbol order. The codes are stored in stream order, first bit in
+ * bit 0. Returns non-zero if the lengths over-subscribe the code space.
+ */
+static int
+assign_canonical_codes(const unsigned char *lens, uint64_t *codes)
+{
+    uint64_t bl_count[HUFFMAN_MAX_CODE_BITS + 1];
+    uint64_t next_code[HUFFMAN_MAX_CODE_BITS + 1];
+    uint64_t code = 0;
+    unsigned int i, len;
+
+    memset(bl_count, 0, sizeof(bl_count));
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+    {
+        if(lens[i] > HUFFMAN_MAX_CODE_BITS)
+            return 1;
+        ++bl_count[lens[i]];
+    }
+
+    bl_count[0] = 0;
+    for(len = 1; len <= HUFFMAN_MAX_CODE_BITS; ++len)
+    {
+        code = (code + bl_count[len - 1]) << 1;
+        next_code[len] = code;
+        if(code + bl_count[len] > (uint64_t)1 << len)
+            return 1;
+    }
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+    {
+        uint64_t c, reversed = 0;
+
+        if(lens[i] == 0)
+        {
+            codes[i] = 0;
+            continue;
+        }
+
+        /* The most significant bit of a canonical code goes first. */
+        c = next_code[lens[i]]++;
+        for(len = 0; len < lens[i]; ++len)
+            reversed = reversed << 1 | ((c >> len) & 1);
+        codes[i] = reversed;
+    }
+
+    return 0;
+}
+
+/*
+ * pack_code_lengths writes the code length of every symbol to out,
+ * which must hold MAX_SYMBOLS bytes, and returns the number of bytes
+ * written. Each length takes one byte; a byte with the high bit set
+ * stands for a run of (byte & 0x7F) + 1 unused symbols.
+ */
+static unsigned int
+pack_code_lengths(const unsigned char *lens, unsigned char *out)
+{
+    unsigned int i = 0, n = 0;
+
+    while(i < MAX_SYMBOLS)
+    {
+        unsigned int run = 0;
+
+        if(lens[i])
+        {
+            out[n++] = lens[i++];
+            continue;
+        }
+
+        while(i < MAX_SYMBOLS && lens[i] == 0 && run < 0x80)
+        {
+            ++run;
+            ++i;
+        }
+        out[n++] = (unsigned char)(0x80 | (run - 1));
+    }
+
+    return n;
+}
+
+/*
+ * unpack_code_lengths reads the packed code lengths at *pindex into
+ * lens and stores the number of symbols in use in *pnsyms.
+ */
+static int
+unpack_code_lengths(const unsigned char *buf,
+                    size_t buflen,
+                    size_t *pindex,
+                    unsigned char *lens,
+                    unsigned int *pnsyms)
+{
+    unsigned int i = 0, nsyms = 0;
+
+    while(i < MAX_SYMBOLS)
+    {
+        unsigned char b;
+
+        if(*pindex >= buflen)
+            return 1;
+
+        b = buf[(*pindex)++];
+        if(b & 0x80)
+        {
+            unsigned int run = (b & 0x7F) + 1u;
+            if(run > MAX_SYMBOLS - i)
+                return 1;
+            memset(lens + i, 0, run);
+            i += run;
+        }
+        else
+        {
+            if(b > HUFFMAN_MAX_CODE_BITS)
+                return 1;
+            if(b)
+                ++nsyms;
+            lens[i++] = b;
+        }
+    }
+
+    *pnsyms = nsyms;
+    return 0;
+}
+
+static int
+build_decoder_from_lengths(huffman_decoder *d, const unsigned char *lens)
+{
+    uint64_t codes[MAX_SYMBOLS];
+    double t = stats_clock();
+
+    if(assign_canonical_codes(lens, codes)
+       || build_decoder(d, codes, lens))
+        return 1;
+
+    add_phase(HUFFMAN_PHASE_TABLE, t, d->size * sizeof(*d->table));
+    note_code_length(d->maxlen);
+    return 0;
+}
+
+static unsigned char
+lone_symbol(const unsigned char *lens)
+{
+    unsigned int i;
+
+    for(i = 0; i < MAX_SYMBOLS && lens[i] == 0; ++i)
+        ;
+    return (unsigned char)i;
+}
+
+/*
+ * stream_length returns how many of the rawlen symbols of a 4-stream
+ * block stream k holds.
+ */
+static size_t
+stream_length(uint64_t rawlen, unsigned int k)
+{
+    uint64_t quarter = (rawlen + HUFFMAN_STREAMS - 1) / HUFFMAN_STREAMS;
+    uint64_t start = quarter * k;
+
+    if(start >= rawlen)
+        return 0;
+    return (size_t)(rawlen - start < quarter ? rawlen - start : quarter);
+}
+
+/*
+ * block_streams returns the number of streams to split a block of len
+ * bytes into.
+ */
+static unsigned int
+block_streams(size_t len, const huffman_options *opts)
+{
+    return opts->streams > 1 && len >= HUFFMAN_STREAMS_MIN
+           ? HUFFMAN_STREAMS : 1;
+}
+
+/*
+ * put_block_header packs the header of a block of rawlen bytes with
+ * code lengths lens and codebytes bytes of codes into header. Given
+ * the byte sizes of its streams in sizes, the block is a 4-stream one.
+ */
+static void
+put_block_header(uint64_t rawlen,
+                 const unsigned char *lens,
+                 const uint64_t *sizes,
+                 uint64_t codebytes,
+                 unsigned char *header,
+                 unsigned int *pheaderlen)
+{
+    unsigned char packed[MAX_SYMBOLS];
+    unsigned char sizebytes[MAX_STREAM_SIZES];
+    unsigned int k, npacked, nsizes = 0;
+
+    if(sizes)
+        for(k = 0; k + 1 < HUFFMAN_STREAMS; ++k)
+            nsizes += put_varint(sizebytes + nsizes, sizes[k]);
+
+    npacked = pack_code_lengths(lens, packed);
+    header[0] = sizes ? HUFFMAN_BLOCK_STREAMS : HUFFMAN_BLOCK_HUFFMAN;
+    *pheaderlen = 1;
+    *pheaderlen += put_varint(header + *pheaderlen, rawlen);
+    *pheaderlen += put_varint(header + *pheaderlen,
+                              npacked + nsizes + codebytes);
+    memcpy(header + *pheaderlen, packed, npacked);
+    *pheaderlen += npacked;
+    memcpy(header + *pheaderlen, sizebytes, nsizes);
+    *pheaderlen += nsizes;
+}
+
+/*
+ * put_raw_header packs the header of a stored or run block of rawlen
+ * bytes with paylen bytes of payload into header and returns its size.
+ */
+static unsigned int
+put_raw_header(unsigned char type,
+               uint64_t rawlen,
+               uint64_t paylen,
+               unsigned char *header)
+{
+    unsigned int n = 1;
+
+    header[0] = type;
+    n += put_varint(header + n, rawlen);
+    n += put_varint(header + n, paylen);
+    return n;
+}
+
+/*
+ * build_block computes canonical codes for the symbol counts in
+ * counts, fills the flat encoder table and packs the block header into
+ * header. The number of payload bytes that follow the header is stored
+ * in *pcodebytes. Given the counts of each of its streams in
+ * streamcounts, the block is split into HUFFMAN_STREAMS streams.
+ *
+ * The block type follows from the counts: a block of one byte value
+ * becomes a run block, with its byte at the end of the header, and one
+ * the codes would not shrink a stored block.
+ */
+static int
+build_block(const uint64_t *counts,
+            const uint64_t (*streamcounts)[MAX_SYMBOLS],
+            uint64_t rawlen,
+            unsigned int maxbits,
+            huffman_codeword *table,
+            unsigned char *header,
+            unsigned int *pheaderlen,
+            uint64_t *pcodebytes)
+{
+    unsigned char lens[MAX_SYMBOLS];
+    uint64_t codes[MAX_SYMBOLS];
+    uint64_t sizes[HUFFMAN_STREAMS];
+    uint64_t numbits = 0, codebytes;
+    unsigned int i, k, nsyms = 0, maxlen = 0;
+    double t = stats_clock();
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+        nsyms += counts[i] != 0;
+
+    if(nsyms == 1)
+    {
+        for(i = 0; counts[i] == 0; ++i)
+            ;
+        *pheaderlen = put_raw_header(HUFFMAN_BLOCK_RUN, rawlen, 1, header);
+        header[(*pheaderlen)++] = (unsigned char)i;
+        *pcodebytes = 0;
+        add_phase(HUFFMAN_PHASE_TABLE, t, *pheaderlen);
+        return 0;
+    }
+
+    calculate_code_lengths(counts, maxbits, lens);
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+        numbits += counts[i] * lens[i];
+
+    if(assign_canonical_codes(lens, codes))
+        return 1;
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+    {
+        table[i].code = codes[i];
+        table[i].len = lens[i];
+        if(lens[i] > maxlen)
+            maxlen = lens[i];
+    }
+    add_phase(HUFFMAN_PHASE_TREE, t, rawlen);
+    note_code_length(maxlen);
+
+    t = stats_clock();
+
+    if(!streamcounts)
+    {
+        codebytes = numbytes_from_numbits(numbits);
+        put_block_header(rawlen, lens, NULL, codebytes, header, pheaderlen);
+    }
+    else
+    {
+        codebytes = 0;
+        for(k = 0; k < HUFFMAN_STREAMS; ++k)
+        {
+            uint64_t streambits = 0;
+
+            for(i = 0; i < MAX_SYMBOLS; ++i)
+                streambits += streamcounts[k][i] * table[i].len;
+            sizes[k] = numbytes_from_numbits(streambits);
+            codebytes += sizes[k];
+        }
+
+        put_block_header(rawlen, lens, sizes, codebytes, header, pheaderlen);
+    }
+
+    /* Random or already compressed data, or a length-limited code that
+       needs more than 8 bits a symbol, is cheaper stored as it is. */
+    if(1 + 2 * varint_len(rawlen) + rawlen <= *pheaderlen + codebytes)
+    {
+        *pheaderlen = put_raw_header(HUFFMAN_BLOCK_STORED, rawlen, rawlen,
+                                     header);
+        codebytes = rawlen;
+    }
+    add_phase(HUFFMAN_PHASE_TABLE, t, *pheaderlen);
+
+    *pcodebytes = codebytes;
+    return 0;
+}
+
+/*
+ * prepare_block builds the table and header of a block holding the
+ * len bytes at in.
+ */
+static int
+prepare_block(const unsigned char *in,
+              size_t len,
+              const huffman_options *opts,
+              huffman_codeword *table,
+              unsigned char *header,
+              unsigned int *pheaderlen,
+              uint64_t *pcodebytes)
+{
+    uint64_t counts[MAX_SYMBOLS];
+    uint64_t streamcounts[HUFFMAN_STREAMS][MAX_SYMBOLS];
+    size_t start = 0;
+    unsigned int i, k;
+    double t = stats_clock();
+
+    if(block_streams(len, opts) == 1)
+    {
+        count_symbols(in, len, counts);
+        add_phase(HUFFMAN_PHASE_HISTOGRAM, t, len);
+        return build_block(counts, NULL, len, opts->max_code_length, table,
+                           header, pheaderlen, pcodebytes);
+    }
+
+    memset(counts, 0, sizeof(counts));
+    for(k = 0; k < HUFFMAN_STREAMS; ++k)
+    {
+        size_t n = stream_length(len, k);
+
+        count_symbols(in + start, n, streamcounts[k]);
+        for(i = 0; i < MAX_SYMBOLS; ++i)
+            counts[i] += streamcounts[k][i];
+        start += n;
+    }
+    add_phase(HUFFMAN_PHASE_HISTOGRAM, t, len);
+
+    return build_block(counts, (const uint64_t (*)[MAX_SYMBOLS])streamcounts,
+                       len, opts->max_code_length, table, header,
+                       pheaderlen, pcodebytes);
+}
+
+/*
+ * is_data_block tells whether a block type byte starts a block of
+ * data.
+ */
+static int
+is_data_block(unsigned char type)
+{
+    return type == HUFFMAN_BLOCK_HUFFMAN || type == HUFFMAN_BLOCK_STREAMS
+           || type == HUFFMAN_BLOCK_STORED || type == HUFFMAN_BLOCK_RUN;
+}
+
+/*
+ * is_raw_block tells whether a block type byte starts a block that
+ * holds its bytes uncoded.
+ */
+static int
+is_raw_block(unsigned char type)
+{
+    return type == HUFFMAN_BLOCK_STORED || type == HUFFMAN_BLOCK_RUN;
+}
+
+/*
+ * bad_block_size tells whether a block's lengths don't fit its type.
+ */
+static int
+bad_block_size(unsigned char type, uint64_t rawlen, uint64_t paylen)
+{
+    switch(type)
+    {
+    case HUFFMAN_BLOCK_STREAMS:
+        return rawlen > HUFFMAN_BLOCK_SIZE || paylen > MAX_STREAMS_PAYLOAD;
+    case HUFFMAN_BLOCK_STORED:
+        return rawlen > HUFFMAN_BLOCK_SIZE || paylen != rawlen;
+    case HUFFMAN_BLOCK_RUN:
+        return paylen != 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * is_stream_end tells whether a block type byte ends the blocks of a
+ * stream.
+ */
+static int
+is_stream_end(unsigned char type)
+{
+    return type == HUFFMAN_BLOCK_END || type == HUFFMAN_BLOCK_INDEX;
+}
+
+typedef struct block_entry_tag
+{
+    /* The block's offset in the stream and its size, header included. */
+    uint64_t offset;
+    uint64_t complen;
+    /* The block's offset and length in the decoded data. */
+    uint64_t rawoffset;
+    uint64_t rawlen;
+} block_entry;
+
+typedef struct block_index_tag
+{
+    block_entry *entries;
+    size_t n;
+    size_t cap;
+} block_index;
+
+static void
+free_index(block_index *ix)
+{
+    free(ix->entries);
+    ix->entries = NULL;
+    ix->n = ix->cap = 0;
+}
+
+static int
+add_index_entry(block_index *ix, uint64_t complen, uint64_t rawlen)
+{
+    block_entry *e;
+
+    if(ix->n == ix->cap)
+    {
+        size_t newcap = ix->cap ? 2 * ix->cap : 64;
+        block_entry *tmp =
+            (block_entry*)counted_realloc(ix->entries, newcap * sizeof(*tmp));
+        if(!tmp)
+            return 1;
+        ix->entries = tmp;
+        ix->cap = newcap;
+    }
+
+    e = &ix->entries[ix->n];
+    e->offset = ix->n ? e[-1].offset + e[-1].complen : HUFFMAN_MAGIC_LEN;
+    e->rawoffset = ix->n ? e[-1].rawoffset + e[-1].rawlen : 0;
+    e->complen = complen;
+    e->rawlen = rawlen;
+    ++ix->n;
+    return 0;
+}
+
+static void
+store_le64(unsigned char *p, uint64_t v)
+{
+    unsigned int i;
+
+    for(i = 0; i < 8; ++i)
+        p[i] = (unsigned char)(v >> 8 * i);
+}
+
+/*
+ * pack_stream_end returns a malloc'd buffer holding what follows the
+ * last block of a stream: the end byte, or the index and trailer if
+ * there is more than one block.
+ */
+static unsigned char*
+pack_stream_end(const block_index *ix, size_t *plen)
+{
+    unsigned char *buf;
+    size_t i, n = 0;
+
+    buf = (unsigned char*)counted_malloc(1 + MAX_VARINT_LEN
+                                 + ix->n * 2 * MAX_VARINT_LEN
+                                 + HUFFMAN_TRAILER_LEN);
+    if(!buf)
+        return NULL;
+
+    if(ix->n < 2)
+    {
+        buf[0] = HUFFMAN_BLOCK_END;
+        *plen = 1;
+        return buf;
+    }
+
+    buf[n++] = HUFFMAN_BLOCK_INDEX;
+    n += put_varint(buf + n, ix->n);
+    for(i = 0; i < ix->n; ++i)
+    {
+        n += put_varint(buf + n, ix->entries[i].complen);
+        n += put_varint(buf + n, ix->entries[i].rawlen);
+    }
+
+    store_le64(buf + n, n);
+    memcpy(buf + n + 8, huffman_index_magic, HUFFMAN_MAGIC_LEN);
+    *plen = n + HUFFMAN_TRAILER_LEN;
+    return buf;
+}
+
+/*
+ * parse_index reads the index in the len bytes at buf, trailer
+ * included, into ix. indexpos is the offset of the index in the
+ * stream, which the block sizes must add up to.
+ */
+static int
+parse_index(const unsigned char *buf,
+            size_t len,
+            uint64_t indexpos,
+            block_index *ix)
+{
+    uint64_t count, complen, rawlen, i;
+    size_t pos = 1;
+
+    memset(ix, 0, sizeof(*ix));
+    if(len < 1 + HUFFMAN_TRAILER_LEN || buf[0] != HUFFMAN_BLOCK_INDEX)
+        return 1;
+
+    len -= HUFFMAN_TRAILER_LEN;
+    if(get_varint(buf, len, &pos, &count) || count > len)
+        return 1;
+
+    for(i = 0; i < count; ++i)
+    {
+        if(get_varint(buf, len, &pos, &complen)
+           || get_varint(buf, len, &pos, &rawlen)
+           || add_index_entry(ix, complen, rawlen))
+        {
+            free_index(ix);
+            return 1;
+        }
+    }
+
+    if(pos != len || count == 0
+       || ix->entries[count - 1].offset + complen != indexpos)
+    {
+        free_index(ix);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * index_position checks the trailer at the end of a stream of len
+ * bytes and returns the offset of its index, or 0 if it has none.
+ */
+static uint64_t
+index_position(const unsigned char *trailer, uint64_t len)
+{
+    uint64_t indexlen;
+
+    if(len < HUFFMAN_MAGIC_LEN + 1 + HUFFMAN_TRAILER_LEN
+       || memcmp(trailer + 8, huffman_index_magic, HUFFMAN_MAGIC_LEN) != 0)
+        return 0;
+
+    indexlen = load_le64(trailer);
+    if(indexlen > len - HUFFMAN_TRAILER_LEN - HUFFMAN_MAGIC_LEN)
+        return 0;
+
+    return len - HUFFMAN_TRAILER_LEN - indexlen;
+}
+
+typedef struct block_header_tag
+{
+    unsigned char type;
+    uint64_t rawlen;
+    uint64_t paylen;
+} block_header;
+
+/*
+ * read_block_header parses the block header at *pindex and checks
+ * that the block's payload lies within buf.
+ */
+static int
+read_block_header(const unsigned char *buf,
+                  size_t buflen,
+                  size_t *pindex,
+                  block_header *h)
+{
+    if(*pindex >= buflen)
+        return 1;
+
+    h->type = buf[(*pindex)++];
+    h->rawlen = h->paylen = 0;
+    if(is_stream_end(h->type))
+        return 0;
+
+    if(!is_data_block(h->type)
+       || get_varint(buf, buflen, pindex, &h->rawlen)
+       || get_varint(buf, buflen, pindex, &h->paylen)
+       || bad_block_size(h->type, h->rawlen, h->paylen))
+        return 1;
+
+    return h->paylen > buflen - *pindex;
+}
+
+/*
+ * lookup_code returns the table entry for the code at the bottom of
+ * bitbuf and stores the code's length in *plen.
+ */
+KERNEL_BODY const huffman_entry*
+lookup_code(const huffman_entry *table,
+            uint64_t rootmask,
+            uint64_t bitbuf,
+            unsigned int *plen)
+{
+    const huffman_entry *e = &table[bitbuf & rootmask];
+    unsigned int n = 0;
+
+    while(e->link)
+    {
+        unsigned int link = e->link;
+        n += e->bits;
+        bitbuf >>= e->bits;
+        e = &table[e->value + (bitbuf & ((1u << link) - 1))];
+    }
+
+    *plen = n + e->bits;
+    return e;
+}
+
+/*
+ * decode_streams decodes the first count of the rawlen symbols of a
+ * 4-stream block, whose stream sizes and streams are the len bytes at
+ * buf, into out. A whole block is decoded a few symbols from each
+ * stream in turn, which keeps four independent lookups in flight; the
+ * ends of the streams and a partial block go one stream at a time.
+ */
+typedef int decode_streams_fn(const huffman_decoder *d,
+                              const unsigned char *buf,
+                              size_t len,
+                              uint64_t rawlen,
+                              unsigned char *out,
+                              uint64_t count);
+
+KERNEL_BODY int
+decode_streams_body(const huffman_decoder *d,
+                    const unsigned char *buf,
+                    size_t len,
+                    uint64_t rawlen,
+                    unsigned char *out,
+                    uint64_t count)
+{
+    const huffman_entry *table = d->table;
+    uint64_t rootmask = ((uint64_t)1 << d->rootbits) - 1;
+    bit_reader br[HUFFMAN_STREAMS];
+    size_t want[HUFFMAN_STREAMS];
+    uint64_t sizes[HUFFMAN_STREAMS - 1], total = 0;
+    size_t pos = 0, quarter, i = 0;
+    unsigned int group = 56 / d->maxlen, k, j;
+    double t = stats_clock();
+
+    for(k = 0; k < HUFFMAN_STREAMS - 1; ++k)
+    {
+        if(get_varint(buf, len, &pos, &sizes[k]) || sizes[k] > len)
+            return 1;
+        total += sizes[k];
+    }
+    if(total > len - pos)
+        return 1;
+
+    for(k = 0; k < HUFFMAN_STREAMS; ++k)
+    {
+        size_t size = k < HUFFMAN_STREAMS - 1 ? (size_t)sizes[k]
+                      : len - pos;
+
+        init_bit_reader(&br[k], buf + pos, size, 1);
+        pos += size;
+    }
+
+    quarter = stream_length(rawlen, 0);
+    for(k = 0; k < HUFFMAN_STREAMS; ++k)
+    {
+        size_t n = stream_length(rawlen, k);
+
+        want[k] = count <= (uint64_t)quarter * k ? 0
+                  : count - quarter * k < n ? (size_t)(count - quarter * k)
+                  : n;
+    }
+
+    /* The last stream is the shortest, so while it has symbols left
+       they all do. */
+    if(count == rawlen)
+    {
+        while(want[HUFFMAN_STREAMS - 1] - i >= group)
+        {
+            for(k = 0; k < HUFFMAN_STREAMS; ++k)
+                if(br[k].end - br[k].cur < 8)
+                    break;
+            if(k < HUFFMAN_STREAMS)
+                break;
+
+            for(k = 0; k < HUFFMAN_STREAMS; ++k)
+            {
+                br[k].bitbuf |= load_le64(br[k].cur) << br[k].bitcount;
+                br[k].cur += (63 - br[k].bitcount) >> 3;
+                br[k].bitcount |= 56;
+            }
+
+            for(j = 0; j < group; ++j, ++i)
+            {
+                for(k = 0; k < HUFFMAN_STREAMS; ++k)
+                {
+                    unsigned int n;
+                    const huffman_entry *e = lookup_code(table, rootmask,
+                                                         br[k].bitbuf, &n);
+
+                    if(e->bits == 0)
+                        return 1;
+                    out[quarter * k + i] = (unsigned char)e->value;
+                    br[k].bitbuf >>= n;
+                    br[k].bitcount -= n;
+                }
+            }
+        }
+    }
+
+    for(k = 0; k < HUFFMAN_STREAMS; ++k)
+    {
+        size_t done = 0;
+
+        if(want[k] > i
+           && (decode_symbols_body(d, &br[k], out + quarter * k + i,
+                                   want[k] - i, &done)
+               || done != want[k] - i))
+            return 1;
+    }
+
+    add_phase(HUFFMAN_PHASE_DECODE, t, count);
+    return 0;
+}
+
+static int
+decode_streams_portable(const huffman_decoder *d,
+                        const unsigned char *buf,
+                        size_t len,
+                        uint64_t rawlen,
+                        unsigned char *out,
+                        uint64_t count)
+{
+    return decode_streams_body(d, buf, len, rawlen, out, count);
+}
+
+#if HUFFMAN_DISPATCH
+static int TARGET("bmi2")
+decode_streams_bmi2(const huffman_decoder *d,
+                    const unsigned char *buf,
+                    size_t len,
+                    uint64_t rawlen,
+                    unsigned char *out,
+                    uint64_t count)
+{
+    return decode_streams_body(d, buf, len, rawlen, out, count);
+}
+#endif
+
+static decode_streams_fn *decode_streams = decode_streams_portable;
+
+/*
+ * decode_block decodes the first count of the h->rawlen bytes held in
+ * the payload of a data block into out. decode_block_with does the
+ * same with the table storage of dec.
+ */
+static int
+decode_block_with(huffman_decoder *dec,
+                  const unsigned char *buf,
+                  const block_header *h,
+                  unsigned char *out,
+                  uint64_t count)
+{
+    unsigned char lens[MAX_SYMBOLS];
+    bit_reader br;
+    unsigned int nsyms;
+    size_t pos = 0, done = 0;
+    double t = stats_clock();
+    int rc;
+
+    if(count > h->rawlen)
+        return 1;
+
+    if(h->type == HUFFMAN_BLOCK_STORED)
+    {
+        memcpy(out, buf, count);
+        add_phase(HUFFMAN_PHASE_DECODE, t, count);
+        return 0;
+    }
+
+    if(h->type == HUFFMAN_BLOCK_RUN)
+    {
+        memset(out, buf[0], count);
+        add_phase(HUFFMAN_PHASE_DECODE, t, count);
+        return 0;
+    }
+
+    if(unpack_code_lengths(buf, h->paylen, &pos, lens, &nsyms))
+        return 1;
+
+    if(count == 0)
+        return 0;
+
+    if(nsyms == 1)
+    {
+        memset(out, lone_symbol(lens), count);
+        return 0;
+    }
+
+    if(build_decoder_from_lengths(dec, lens))
+        return 1;
+
+    if(h->type == HUFFMAN_BLOCK_STREAMS)
+        return decode_streams(dec, buf + pos, h->paylen - pos, h->rawlen,
+                              out, count);
+
+    t = stats_clock();
+    init_bit_reader(&br, buf + pos, h->paylen - pos, 1);
+    rc = decode_symbols(dec, &br, out, count, &done);
+    add_phase(HUFFMAN_PHASE_DECODE, t, done);
+    return rc || done != count;
+}
+
+static int
+decode_block(const unsigned char *buf,
+             const block_header *h,
+             unsigned char *out,
+             uint64_t count)
+{
+    huffman_decoder dec;
+    int rc;
+
+    init_decoder(&dec);
+    rc = decode_block_with(&dec, buf, h, out, count);
+    free_decoder(&dec);
+    return rc;
+}
+
+/*
+ * list_blocks finds the blocks of the version 2 stream in buf, from
+ * its index if it has one or else by walking the block headers.
+ */
+static int
+list_blocks(const unsigned char *buf, size_t buflen, block_index *ix)
+{
+    uint64_t indexpos = 0;
+    size_t pos = HUFFMAN_MAGIC_LEN;
+    block_header h;
+
+    memset(ix, 0, sizeof(*ix));
+    if(buflen >= HUFFMAN_TRAILER_LEN)
+        indexpos = index_position(buf + buflen - HUFFMAN_TRAILER_LEN, buflen);
+    if(indexpos)
+        return parse_index(buf + indexpos, buflen - indexpos, indexpos, ix);
+
+    for(;;)
+    {
+        size_t start = pos;
+
+        if(read_block_header(buf, buflen, &pos, &h))
+        {
+            free_index(ix);
+            return 1;
+        }
+        if(is_stream_end(h.type))
+            return 0;
+
+        pos += h.paylen;
+        if(add_index_entry(ix, pos - start, h.rawlen))
+        {
+            free_index(ix);
+            return 1;
+        }
+    }
+}
+
+/*
+ * The encoder packs whole codes into a 64-bit accumulator and stores
+ * 32 bits at a time, little endian, so that the first bit of the
+ * stream lands in the low bit of the first byte.
+ */
+typedef struct bit_writer_tag
+{
+    unsigned char *out;
+    uint64_t bitbuf;
+    unsigned int bitcount;
+} bit_writer;
+
+static void
+store_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+KERNEL_BODY void
+put_bits(bit_writer *bw, uint64_t code, unsigned int len)
+{
+    bw->bitbuf |= code << bw->bitcount;
+    bw->bitcount += len;
+    if(bw->bitcount >= 32)
+    {
+        store_le32(bw->out, (uint32_t)bw->bitbuf);
+        bw->out += 4;
+        bw->bitbuf >>= 32;
+        bw->bitcount -= 32;
+    }
+}
+
+/*
+ * encode_symbols appends the codes of the n bytes at in to bw. Only
+ * whole 32-bit words are stored; flush_bits writes out the rest.
+ */
+typedef void encode_symbols_fn(const huffman_codeword *table,
+                               const unsigned char *in,
+                               size_t n,
+                               bit_writer *bw);
+
+KERNEL_BODY void
+encode_symbols_body(const huffman_codeword *table,
+                    const unsigned char *in,
+                    size_t n,
+                    bit_writer *bw)
+{
+    size_t i;
+
+    for(i = 0; i < n; ++i)
+    {
+        const huffman_codeword *cw = &table[in[i]];
+
+        /* The accumulator holds fewer than 32 bits between codes, so
+           only codes longer than 32 bits need to go in two parts. */
+        if(cw->len > 32)
+        {
+            put_bits(bw, cw->code & 0xFFFFFFFFu, 32);
+            put_bits(bw, cw->code >> 32, cw->len - 32);
+        }
+        else
+        {
+            put_bits(bw, cw->code, cw->len);
+        }
+    }
+}
+
+static void
+encode_symbols_portable(const huffman_codeword *table,
+                        const unsigned char *in,
+                        size_t n,
+                        bit_writer *bw)
+{
+    encode_symbols_body(table, in, n, bw);
+}
+
+#if HUFFMAN_DISPATCH
+static void TARGET("bmi2")
+encode_symbols_bmi2(const huffman_codeword *table,
+                    const unsigned char *in,
+                    size_t n,
+                    bit_writer *bw)
+{
+    encode_symbols_body(table, in, n, bw);
+}
+#endif
+
+static encode_symbols_fn *encode_symbols = encode_symbols_portable;
+
+#if HUFFMAN_DISPATCH
+/*
+ * bind_kernels runs when the library is loaded. Setting HUFFMAN_CPU
+ * to "portable" in the environment keeps the plain C kernels, to test
+ * them on CPUs that have faster ones.
+ */
+static void __attribute__((constructor))
+bind_kernels(void)
+{
+    const char *cpu = getenv("HUFFMAN_CPU");
+
+    if(cpu && strcmp(cpu, "portable") == 0)
+        return;
+
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        count_bytes = count_bytes_avx2;
+    if(__builtin_cpu_supports("bmi2"))
+    {
+        decode_symbols = decode_symbols_bmi2;
+        decode_streams = decode_streams_bmi2;
+        encode_symbols = encode_symbols_bmi2;
+    }
+}
+#endif
+
+static void
+flush_bits(bit_writer *bw)
+{
+    while(bw->bitcount > 0)
+    {
+        *bw->out++ = (unsigned char)bw->bitbuf;
+        bw->bitbuf >>= 8;
+        bw->bitcount = bw->bitcount > 8 ? bw->bitcount - 8 : 0;
+    }
+}
+
+/*
+ * do_memory_encode writes the codes of the bufinlen bytes at bufin to
+ * out, as nstreams streams one after the other.
+ */
+static void
+do_memory_encode(unsigned char *out,
+                 const unsigned char* bufin,
+                 size_t bufinlen,
+                 const huffman_codeword *table,
+                 unsigned int nstreams)
+{
+    bit_writer bw;
+    unsigned int k;
+
+    bw.out = out;
+    for(k = 0; k < nstreams; ++k)
+    {
+        size_t n = nstreams > 1 ? stream_length(bufinlen, k) : bufinlen;
+
+        bw.bitbuf = 0;
+        bw.bitcount = 0;
+        encode_symbols(table, bufin, n, &bw);
+        flush_bits(&bw);
+        bufin += n;
+    }
+}
+
+/*
+ * encode_payload writes what follows the header of a block of the len
+ * bytes at in that prepare_block gave the header and table of.
+ */
+static void
+encode_payload(unsigned char *out,
+               const unsigned char *in,
+               size_t len,
+               const unsigned char *header,
+               const huffman_codeword *table,
+               const huffman_options *opts)
+{
+    double t = stats_clock();
+
+    if(header[0] == HUFFMAN_BLOCK_STORED)
+        memcpy(out, in, len);
+    else if(header[0] != HUFFMAN_BLOCK_RUN)
+        do_memory_encode(out, in, len, table, block_streams(len, opts));
+    add_phase(HUFFMAN_PHASE_ENCODE, t, len);
+}
+
+/*
+ * Fast mode.
+ *
+ * Counting a block before coding it reads the block twice. In fast
+ * mode the codes of a large block come from HUFFMAN_SAMPLE_CHUNKS
+ * evenly spaced chunks of it instead, and every byte value gets a code
+ * so the bytes the sample missed still encode. The size of the codes
+ * is then only known once they are written, so the header is packed
+ * last. A block the sampled codes would not shrink is stored.
+ */
+#define HUFFMAN_SAMPLE_CHUNKS 16
+#define HUFFMAN_SAMPLE_CHUNK 1024
+#define SAMPLED_CODE_RUN 4096
+
+/*
+ * block_code_bound returns the most code bytes a block of len bytes
+ * takes in either mode.
+ */
+static size_t
+block_code_bound(size_t len)
+{
+    return len + HUFFMAN_STREAMS;
+}
+
+/*
+ * is_sampled tells whether a block of len bytes gets its codes from a
+ * sample. Sampling a small block would save next to nothing.
+ */
+static int
+is_sampled(size_t len, const huffman_options *opts)
+{
+    return opts->fast
+           && len >= 2 * HUFFMAN_SAMPLE_CHUNKS * HUFFMAN_SAMPLE_CHUNK;
+}
+
+static void
+sample_symbols(const unsigned char *in, size_t len, uint64_t *counts)
+{
+    size_t stride = len / HUFFMAN_SAMPLE_CHUNKS, i;
+    unsigned int c;
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+        counts[i] = 1;
+
+    for(c = 0; c < HUFFMAN_SAMPLE_CHUNKS; ++c)
+    {
+        const unsigned char *p = in + c * stride;
+
+        for(i = 0; i < HUFFMAN_SAMPLE_CHUNK; ++i)
+            ++counts[p[i]];
+    }
+}
+
+/*
+ * encode_symbols_bounded is encode_symbols for codes of up to maxlen
+ * bits that must not be written past limit. It gives up, returning
+ * non-zero, once the next run of symbols might not fit.
+ */
+static int
+encode_symbols_bounded(const huffman_codeword *table,
+                       unsigned int maxlen,
+                       const unsigned char *in,
+                       size_t n,
+                       bit_writer *bw,
+                       const unsigned char *limit)
+{
+    while(n > 0)
+    {
+        size_t run = n < SAMPLED_CODE_RUN ? n : SAMPLED_CODE_RUN;
+
+        /* Up to 32 bits are pending and the flush adds up to 4 bytes. */
+        if((size_t)(limit - bw->out) < (run * maxlen + 7) / 8 + 8)
+            return 1;
+
+        encode_symbols(table, in, run, bw);
+        in += run;
+        n -= run;
+    }
+
+    return 0;
+}
+
+static int
+set_codewords(const unsigned char *lens,
+              huffman_codeword *table,
+              unsigned int *pmaxlen)
+{
+    uint64_t codes[MAX_SYMBOLS];
+    unsigned int i;
+
+    if(assign_canonical_codes(lens, codes))
+        return 1;
+
+    *pmaxlen = 0;
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+    {
+        table[i].code = codes[i];
+        table[i].len = lens[i];
+        if(lens[i] > *pmaxlen)
+            *pmaxlen = lens[i];
+    }
+
+    return 0;
+}
+
+/*
+ * encode_block_sampled codes the len bytes at in into codes, which
+ * must hold block_code_bound(len) bytes, with codes built from a
+ * sample of them, and packs the block's header.
+ */
+static int
+encode_block_sampled(const unsigned char *in,
+                     size_t len,
+                     const huffman_options *opts,
+                     unsigned char *header,
+                     unsigned int *pheaderlen,
+                     unsigned char *codes,
+                     uint64_t *pcodebytes)
+{
+    huffman_codeword table[MAX_SYMBOLS];
+    unsigned char lens[MAX_SYMBOLS];
+    uint64_t counts[MAX_SYMBOLS];
+    uint64_t sizes[HUFFMAN_STREAMS];
+    uint64_t samplebits = 0, samplelen;
+    unsigned int nstreams = block_streams(len, opts), maxlen, k, seen = 0;
+    const unsigned char *p = in;
+    bit_writer bw;
+    double t = stats_clock();
+    int stored;
+
+    sample_symbols(in, len, counts);
+    samplelen = HUFFMAN_SAMPLE_CHUNKS * HUFFMAN_SAMPLE_CHUNK;
+    add_phase(HUFFMAN_PHASE_HISTOGRAM, t, samplelen);
+    for(k = 0; k < MAX_SYMBOLS; ++k)
+        seen += counts[k] > 1;
+
+    /* A sample of one byte value is likely a run, which counted
+       exactly takes no code bits at all. */
+    if(seen == 1)
+    {
+        if(prepare_block(in, len, opts, table, header, pheaderlen,
+                         pcodebytes))
+            return 1;
+        encode_payload(codes, in, len, header, table, opts);
+        return 0;
+    }
+
+    t = stats_clock();
+    calculate_code_lengths(counts, opts->max_code_length, lens);
+    if(set_codewords(lens, table, &maxlen))
+        return 1;
+    add_phase(HUFFMAN_PHASE_TREE, t, len);
+    note_code_length(maxlen);
+
+    /* Store the block straight away when the sample says the codes
+       would barely shrink it, as running out of room late would code
+       the block twice. */
+    for(k = 0; k < MAX_SYMBOLS; ++k)
+        samplebits += (counts[k] - 1) * lens[k];
+    stored = samplebits >= 8 * samplelen - samplelen / 8;
+
+    t = stats_clock();
+    bw.out = codes;
+    for(k = 0; !stored && k < nstreams; ++k)
+    {
+        size_t n = nstreams > 1 ? stream_length(len, k) : len;
+        unsigned char *start = bw.out;
+
+        bw.bitbuf = 0;
+        bw.bitcount = 0;
+        stored = encode_symbols_bounded(table, maxlen, p, n, &bw,
+                                        codes + len);
+        if(stored)
+            break;
+        flush_bits(&bw);
+        sizes[k] = bw.out - start;
+        p += n;
+    }
+
+    if(!stored)
+    {
+        *pcodebytes = bw.out - codes;
+        add_phase(HUFFMAN_PHASE_ENCODE, t, len);
+        t = stats_clock();
+        put_block_header(len, lens, nstreams > 1 ? sizes : NULL,
+                         *pcodebytes, header, pheaderlen);
+        add_phase(HUFFMAN_PHASE_TABLE, t, *pheaderlen);
+        stored = *pheaderlen + *pcodebytes
+                 >= 1 + 2 * varint_len(len) + len;
+        t = stats_clock();
+    }
+
+    if(stored)
+    {
+        memcpy(codes, in, len);
+        *pheaderlen = put_raw_header(HUFFMAN_BLOCK_STORED, len, len, header);
+        *pcodebytes = len;
+        add_phase(HUFFMAN_PHASE_ENCODE, t, len);
+    }
+
+    return 0;
+}
+
+/*
+ * encode_block codes the len bytes at in into codes, which must hold
+ * block_code_bound(len) bytes, and packs the block's header.
+ */
+static int
+encode_block(const unsigned char *in,
+             size_t len,
+             const huffman_options *opts,
+             unsigned char *header,
+             unsigned int *pheaderlen,
+             unsigned char *codes,
+             uint64_t *pcodebytes)
+{
+    huffman_codeword table[MAX_SYMBOLS];
+
+    if(is_sampled(len, opts))
+        return encode_block_sampled(in, len, opts, header, pheaderlen,
+                                    codes, pcodebytes);
+
+    if(prepare_block(in, len, opts, table, header, pheaderlen, pcodebytes))
+        return 1;
+
+    encode_payload(codes, in, len, header, table, opts);
+    return 0;
+}
+
+/*
+ * encode_block_in_place writes the block holding the len bytes at in
+ * to out, which must hold MAX_BLOCK_HEADER + block_code_bound(len)
+ * bytes, and stores its size in *psize. A sampled block's codes are
+ * written past the largest header and moved down after it.
+ */
+static int
+encode_block_in_place(const unsigned char *in,
+                      size_t len,
+                      const huffman_options *opts,
+                      unsigned char *out,
+                      size_t *psize)
+{
+    unsigned char header[MAX_BLOCK_HEADER];
+    unsigned int headerlen = 0;
+    uint64_t codebytes = 0;
+
+    if(is_sampled(len, opts))
+    {
+        if(encode_block_sampled(in, len, opts, header, &headerlen,
+                                out + MAX_BLOCK_HEADER, &codebytes))
+            return 1;
+        memmove(out + headerlen, out + MAX_BLOCK_HEADER, codebytes);
+    }
+    else
+    {
+        huffman_codeword table[MAX_SYMBOLS];
+
+        if(prepare_block(in, len, opts, table, header, &headerlen,
+                         &codebytes))
+            return 1;
+        encode_payload(out + headerlen, in, len, header, table, opts);
+    }
+
+    memcpy(out, header, headerlen);
+    *psize = headerlen + codebytes;
+    return 0;
+}
+
+/*
+ * read_block reads up to len bytes, retrying short reads so that a
+ * pipe or socket yields full blocks. Returns the number of bytes read,
+ * which is less than len only at the end of the input or on error.
+ */
+static size_t
+read_block(FILE *in, unsigned char *buf, size_t len)
+{
+    size_t total = 0, got;
+
+    while(total < len && (got = read_input(buf + total, len - total, in)) > 0)
+        total += got;
+
+    return total;
+}
+
+/*
+ * A regular input file is mapped rather than read, from the current
+ * position to its end, so the histogram and the coders run straight
+ * over the page cache with no copying or per-call stdio overhead.
+ */
+typedef struct mapped_input_tag
+{
+    const unsigned char *data;
+    size_t len;
+    void *base;
+    size_t maplen;
+    off_t start;
+} mapped_input;
+
+/*
+ * map_input maps what is left of in, returning nonzero if in is not a
+ * regular file with something left in it; the caller then reads it
+ * as a stream.
+ */
+static int
+map_input(FILE *in, mapped_input *m, int advice)
+{
+    struct stat st;
+    double t = stats_clock();
+
+    /* Pipelined input is read on the reader thread instead, so the
+       coder doesn't wait on page faults. */
+    memset(m, 0, sizeof(*m));
+    if(cur_pipe)
+        return 1;
+
+    m->start = ftello(in);
+    if(m->start < 0
+       || fstat(fileno(in), &st) != 0
+       || !S_ISREG(st.st_mode)
+       || st.st_size <= m->start
+       || (uint64_t)st.st_size > SIZE_MAX)
+        return 1;
+
+    m->maplen = (size_t)st.st_size;
+    m->base = mmap(NULL, m->maplen, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    if(m->base == MAP_FAILED)
+        return 1;
+
+    /* The advice is only a hint; mapping works without it. */
+    posix_madvise(m->base, m->maplen, advice);
+    m->data = (const unsigned char*)m->base + m->start;
+    m->len = m->maplen - (size_t)m->start;
+    add_phase(HUFFMAN_PHASE_READ, t, m->len);
+    return 0;
+}
+
+/*
+ * unmap_input drops the mapping and leaves in positioned after the
+ * used bytes of it.
+ */
+static int
+unmap_input(FILE *in, mapped_input *m, size_t used)
+{
+    munmap(m->base, m->maplen);
+    return fseeko(in, m->start + (off_t)used, SEEK_SET);
+}
+
+static int
+write_stream_end(FILE *out, const block_index *ix)
+{
+    size_t len;
+    unsigned char *end = pack_stream_end(ix, &len);
+    int rc = !end || write_output(end, len, out) != len;
+
+    free(end);
+    return rc;
+}
+
+/*
+ * encode_file_block encodes the len bytes at in as one block written
+ * to out, growing the code buffer *pbuf as needed.
+ */
+static int
+encode_file_block(const unsigned char *in,
+                  size_t len,
+                  const huffman_options *opts,
+                  FILE *out,
+                  unsigned char **pbuf,
+                  size_t *pcap,
+                  block_index *ix)
+{
+    unsigned char header[MAX_BLOCK_HEADER];
+    unsigned int headerlen = 0;
+    uint64_t codebytes;
+
+    if(block_code_bound(len) > *pcap)
+    {
+        unsigned char *tmp = (unsigned char*)counted_realloc(*pbuf,
+                                                     block_code_bound(len));
+        if(!tmp)
+            return 1;
+        *pbuf = tmp;
+        *pcap = block_code_bound(len);
+    }
+
+    if(encode_block(in, len, opts, header, &headerlen, *pbuf, &codebytes))
+        return 1;
+
+    return write_output(header, headerlen, out) != headerlen
+           || write_output(*pbuf, codebytes, out) != codebytes
+           || add_index_entry(ix, headerlen + codebytes, len);
+}
+
+/*
+ * encode_file huffman encodes in to out. A regular file is mapped;
+ * other input is read once, a block at a time, so it need not be
+ * seekable.
+ */
+static int
+encode_file(FILE *in, FILE *out, const huffman_options *opts)
+{
+    unsigned char *inbuf = NULL, *outbuf = NULL;
+    size_t outcap = 0;
+    block_index ix;
+    mapped_input m;
+    int rc = 0;
+
+    memset(&ix, 0, sizeof(ix));
+    if(write_output(huffman_magic, HUFFMAN_MAGIC_LEN, out)
+       != HUFFMAN_MAGIC_LEN)
+        return 1;
+
+    if(map_input(in, &m, POSIX_MADV_SEQUENTIAL) == 0)
+    {
+        size_t i;
+
+        for(i = 0; rc == 0 && i < m.len; i += HUFFMAN_BLOCK_SIZE)
+        {
+            size_t len = m.len - i < HUFFMAN_BLOCK_SIZE
+                         ? m.len - i : HUFFMAN_BLOCK_SIZE;
+            rc = encode_file_block(m.data + i, len, opts, out, &outbuf,
+                                   &outcap, &ix);
+        }
+
+        if(unmap_input(in, &m, m.len))
+            rc = 1;
+    }
+    else
+    {
+        inbuf = (unsigned char*)counted_malloc(HUFFMAN_BLOCK_SIZE);
+        if(!inbuf)
+            rc = 1;
+
+        while(rc == 0)
+        {
+            size_t len = read_block(in, inbuf, HUFFMAN_BLOCK_SIZE);
+
+            if(ferror(in))
+            {
+                rc = 1;
+                break;
+            }
+
+            if(len == 0)
+                break;
+
+            rc = encode_file_block(inbuf, len, opts, out, &outbuf,
+                                   &outcap, &ix);
+
+            if(len < HUFFMAN_BLOCK_SIZE)
+                break;
+        }
+    }
+
+    if(rc == 0)
+        rc = write_stream_end(out, &ix);
+
+    free_index(&ix);
+    free(inbuf);
+    free(outbuf);
+    return rc;
+}
+
+/*
+ * Block-parallel encoding.
+ *
+ * Blocks are independent, so they can be encoded on a pool of
+ * threads and written out in input order; the result is the same
+ * stream the serial encoders produce.
+ */
+#define HUFFMAN_MAX_THREADS 256
+
+typedef struct block_job_tag
+{
+    const unsigned char *in;
+    size_t len;
+    const huffman_options *opts;
+    huffman_codeword table[MAX_SYMBOLS];
+    unsigned char header[MAX_BLOCK_HEADER];
+    unsigned int headerlen;
+    uint64_t codebytes;
+    /* Where the codes go, and for the file path the buffers the job
+       owns. */
+    unsigned char *out;
+    unsigned char *inbuf;
+    size_t outcap;
+    int done;
+    int rc;
+} block_job;
+
+typedef struct parallel_for_tag
+{
+    pthread_mutex_t lock;
+    unsigned char *jobs;
+    size_t jobsize;
+    size_t njobs;
+    size_t next;
+    void (*fn)(void*);
+    huffman_stats *stats;
+} parallel_for;
+
+static void*
+parallel_for_worker(void *arg)
+{
+    parallel_for *pf = (parallel_for*)arg;
+
+    cur_stats = pf->stats;
+    for(;;)
+    {
+        size_t i;
+
+        pthread_mutex_lock(&pf->lock);
+        i = pf->next < pf->njobs ? pf->next++ : pf->njobs;
+        pthread_mutex_unlock(&pf->lock);
+
+        if(i == pf->njobs)
+            return NULL;
+        pf->fn(pf->jobs + i * pf->jobsize);
+    }
+}
+
+/*
+ * run_parallel calls fn on each of the njobs jobs of jobsize bytes at
+ * jobs, using up to nthreads threads, the calling thread included.
+ */
+static int
+run_parallel(void *jobs,
+             size_t njobs,
+             size_t jobsize,
+             unsigned int nthreads,
+             void (*fn)(void*))
+{
+    pthread_t threads[HUFFMAN_MAX_THREADS];
+    parallel_for pf;
+    unsigned int i, nstarted = 0;
+
+    if(nthreads > njobs)
+        nthreads = (unsigned int)njobs;
+
+    pf.jobs = (unsigned char*)jobs;
+    pf.jobsize = jobsize;
+    pf.njobs = njobs;
+    pf.next = 0;
+    pf.fn = fn;
+    pf.stats = cur_stats;
+    if(pthread_mutex_init(&pf.lock, NULL))
+        return 1;
+
+    for(i = 1; i < nthreads; ++i)
+    {
+        if(pthread_create(&threads[nstarted], NULL, parallel_for_worker, &pf))
+            break;
+        ++nstarted;
+    }
+
+    parallel_for_worker(&pf);
+    for(i = 0; i < nstarted; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&pf.lock);
+    return 0;
+}
+
+static void
+prepare_job(void *arg)
+{
+    block_job *job = (block_job*)arg;
+
+    /* A sampled block's size is only known once it is coded, so it is
+       coded here into a buffer of its own and copied into place. */
+    if(is_sampled(job->len, job->opts))
+    {
+        job->out = (unsigned char*)counted_malloc(block_code_bound(job->len));
+        job->rc = !job->out
+                  || encode_block_sampled(job->in, job->len, job->opts,
+                                          job->header, &job->headerlen,
+                                          job->out, &job->codebytes);
+        return;
+    }
+
+    job->rc = prepare_block(job->in, job->len, job->opts, job->table,
+                            job->header,
+                            &job->headerlen, &job->codebytes);
+}
+
+static void
+encode_job(void *arg)
+{
+    block_job *job = (block_job*)arg;
+
+    if(!is_sampled(job->len, job->opts))
+        encode_payload(job->out, job->in, job->len, job->header, job->table,
+                       job->opts);
+}
+
+/*
+ * free_jobs frees jobs along with the codes of sampled blocks that
+ * haven't been copied into place.
+ */
+static void
+free_jobs(block_job *jobs, size_t njobs)
+{
+    size_t i;
+
+    for(i = 0; i < njobs; ++i)
+        if(is_sampled(jobs[i].len, jobs[i].opts))
+            free(jobs[i].out);
+    free(jobs);
+}
+
+static unsigned int
+clamp_threads(unsigned int nthreads)
+{
+    if(nthreads < 1)
+        return 1;
+    return nthreads < HUFFMAN_MAX_THREADS ? nthreads : HUFFMAN_MAX_THREADS;
+}
+
+static int
+encode_memory_mt(const unsigned char *bufin,
+                 size_t bufinlen,
+                 unsigned char **pbufout,
+                 size_t *pbufoutlen,
+                 unsigned int nthreads,
+                 const huffman_options *opts)
+{
+    size_t njobs = bufinlen / HUFFMAN_BLOCK_SIZE
+                   + (bufinlen % HUFFMAN_BLOCK_SIZE ? 1 : 0);
+    block_job *jobs = NULL;
+    unsigned char *buf, *end;
+    block_index ix;
+    size_t i, endlen, total = HUFFMAN_MAGIC_LEN;
+
+    /* Ensure the arguments are valid. */
+    if(!pbufout || !pbufoutlen)
+        return 1;
+
+    nthreads = clamp_threads(nthreads);
+
+    if(njobs > 0)
+    {
+        jobs = (block_job*)counted_calloc(njobs, sizeof(block_job));
+        if(!jobs)
+            return 1;
+    }
+
+    /* Build every block's table, then lay the blocks out back to back
+       and encode each straight into its place. */
+    for(i = 0; i < njobs; ++i)
+    {
+        jobs[i].in = bufin + i * HUFFMAN_BLOCK_SIZE;
+        jobs[i].opts = opts;
+        jobs[i].len = i + 1 < njobs
+                      ? HUFFMAN_BLOCK_SIZE
+                      : bufinlen - i * HUFFMAN_BLOCK_SIZE;
+    }
+
+    if(run_parallel(jobs, njobs, sizeof(block_job), nthreads, prepare_job))
+    {
+        free_jobs(jobs, njobs);
+        return 1;
+    }
+
+    memset(&ix, 0, sizeof(ix));
+    for(i = 0; i < njobs; ++i)
+    {
+        if(jobs[i].rc
+           || add_index_entry(&ix, jobs[i].headerlen + jobs[i].codebytes,
+                              jobs[i].len))
+        {
+            free_index(&ix);
+            free_jobs(jobs, njobs);
+            return 1;
+        }
+        total += jobs[i].headerlen + jobs[i].codebytes;
+    }
+
+    end = pack_stream_end(&ix, &endlen);
+    free_index(&ix);
+    buf = end ? (unsigned char*)counted_malloc(total + endlen) : NULL;
+    if(!buf)
+    {
+        free(end);
+        free_jobs(jobs, njobs);
+        return 1;
+    }
+
+    memcpy(buf, huffman_magic, HUFFMAN_MAGIC_LEN);
+    total = HUFFMAN_MAGIC_LEN;
+    for(i = 0; i < njobs; ++i)
+    {
+        memcpy(buf + total, jobs[i].header, jobs[i].headerlen);
+        if(is_sampled(jobs[i].len, opts))
+        {
+            memcpy(buf + total + jobs[i].headerlen, jobs[i].out,
+                   jobs[i].codebytes);
+            free(jobs[i].out);
+        }
+        jobs[i].out = buf + total + jobs[i].headerlen;
+        total += jobs[i].headerlen + jobs[i].codebytes;
+    }
+    memcpy(buf + total, end, endlen);
+    total += endlen;
+    free(end);
+
+    if(run_parallel(jobs, njobs, sizeof(block_job), nthreads, encode_job))
+    {
+        free(buf);
+        free(jobs);
+        return 1;
+    }
+
+    free(jobs);
+    *pbufout = buf;
+    *pbufoutlen = total;
+    return 0;
+}
+
+/*
+ * The file encoder keeps a ring of job slots. The calling thread reads
+ * blocks into free slots and writes finished ones out in order while
+ * the workers encode whatever has been queued.
+ */
+typedef struct encode_pool_tag
+{
+    pthread_mutex_t lock;
+    pthread_cond_t queued_cond;
+    pthread_cond_t done_cond;
+    huffman_stats *stats;
+    block_job *slots;
+    unsigned int nslots;
+    block_index ix;
+    size_t queued;
+    size_t taken;
+    int stop;
+    int ready;
+} encode_pool;
+
+static void
+encode_slot(block_job *job)
+{
+    size_t bound = block_code_bound(job->len);
+
+    job->rc = 0;
+    if(bound > job->outcap)
+    {
+        unsigned char *tmp = (unsigned char*)counted_realloc(job->out, bound);
+        if(tmp)
+        {
+            job->out = tmp;
+            job->outcap = bound;
+        }
+        else
+        {
+            job->rc = 1;
+        }
+    }
+
+    if(job->rc == 0)
+        job->rc = encode_block(job->in, job->len, job->opts, job->header,
+                               &job->headerlen, job->out, &job->codebytes);
+}
+
+static void*
+encode_pool_worker(void *arg)
+{
+    encode_pool *pool = (encode_pool*)arg;
+
+    cur_stats = pool->stats;
+    for(;;)
+    {
+        block_job *job;
+
+        pthread_mutex_lock(&pool->lock);
+        while(!pool->stop && pool->taken == pool->queued)
+            pthread_cond_wait(&pool->queued_cond, &pool->lock);
+        if(pool->taken == pool->queued)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        job = &pool->slots[pool->taken++ % pool->nslots];
+        pthread_mutex_unlock(&pool->lock);
+
+        encode_slot(job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*
+ * write_slot waits for the job in slot seq to finish and writes it.
+ */
+static int
+write_slot(encode_pool *pool, size_t seq, FILE *out)
+{
+    block_job *job = &pool->slots[seq % pool->nslots];
+
+    pthread_mutex_lock(&pool->lock);
+    while(!job->done)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    return job->rc
+           || write_output(job->header, job->headerlen, out) != job->headerlen
+           || write_output(job->out, job->codebytes, out) != job->codebytes
+           || add_index_entry(&pool->ix, job->headerlen + job->codebytes,
+                              job->len);
+}
+
+static int
+init_pool(encode_pool *pool, unsigned int nslots)
+{
+    unsigned int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->stats = cur_stats;
+    pool->slots = (block_job*)counted_calloc(nslots, sizeof(block_job));
+    if(!pool->slots)
+        return 1;
+    pool->nslots = nslots;
+
+    for(i = 0; i < nslots; ++i)
+    {
+        pool->slots[i].inbuf =
+            (unsigned char*)counted_malloc(HUFFMAN_BLOCK_SIZE);
+        pool->slots[i].in = pool->slots[i].inbuf;
+        if(!pool->slots[i].inbuf)
+            return 1;
+    }
+
+    if(pthread_mutex_init(&pool->lock, NULL))
+        return 1;
+    if(pthread_cond_init(&pool->queued_cond, NULL))
+    {
+        pthread_mutex_destroy(&pool->lock);
+        return 1;
+    }
+    if(pthread_cond_init(&pool->done_cond, NULL))
+    {
+        pthread_cond_destroy(&pool->queued_cond);
+        pthread_mutex_destroy(&pool->lock);
+        return 1;
+    }
+
+    pool->ready = 1;
+    return 0;
+}
+
+static void
+free_pool(encode_pool *pool)
+{
+    unsigned int i;
+
+    if(pool->ready)
+    {
+        pthread_cond_destroy(&pool->done_cond);
+        pthread_cond_destroy(&pool->queued_cond);
+        pthread_mutex_destroy(&pool->lock);
+    }
+
+    for(i = 0; pool->slots && i < pool->nslots; ++i)
+    {
+        free(pool->slots[i].inbuf);
+        free(pool->slots[i].out);
+    }
+    free(pool->slots);
+    free_index(&pool->ix);
+}
+
+static int
+encode_file_mt(FILE *in,
+               FILE *out,
+               unsigned int nthreads,
+               const huffman_options *opts)
+{
+    pthread_t threads[HUFFMAN_MAX_THREADS];
+    encode_pool pool;
+    mapped_input m;
+    unsigned int i, nstarted = 0;
+    size_t written = 0, mapped = 0;
+    int ismapped, rc = 0;
+
+    nthreads = clamp_threads(nthreads);
+    if(nthreads == 1)
+        return encode_file(in, out, opts);
+
+    ismapped = map_input(in, &m, POSIX_MADV_SEQUENTIAL) == 0;
+
+    /* Two slots per thread keep the workers busy while the calling
+       thread does I/O. */
+    rc = init_pool(&pool, 2 * nthreads);
+
+    for(i = 0; rc == 0 && i < nthreads; ++i)
+    {
+        if(pthread_create(&threads[nstarted], NULL, encode_pool_worker, &pool))
+            break;
+        ++nstarted;
+    }
+
+    /* With no workers, encode on this thread as run_parallel does. */
+    if(rc == 0 && nstarted == 0)
+    {
+        free_pool(&pool);
+        if(ismapped && unmap_input(in, &m, 0))
+            return 1;
+        return encode_file(in, out, opts);
+    }
+
+    if(rc == 0
+       && write_output(huffman_magic, HUFFMAN_MAGIC_LEN, out)
+          != HUFFMAN_MAGIC_LEN)
+        rc = 1;
+
+    while(rc == 0)
+    {
+        block_job *job = &pool.slots[pool.queued % pool.nslots];
+
+        /* Free the slot by writing out the block it held. */
+        if(pool.queued >= pool.nslots)
+        {
+            rc = write_slot(&pool, written++, out);
+            if(rc)
+                break;
+        }
+
+        if(ismapped)
+        {
+            /* Jobs work on the mapping in place. */
+            job->in = m.data + mapped;
+            job->len = m.len - mapped < HUFFMAN_BLOCK_SIZE
+                       ? m.len - mapped : HUFFMAN_BLOCK_SIZE;
+            mapped += job->len;
+        }
+        else
+        {
+            job->in = job->inbuf;
+            job->len = read_block(in, job->inbuf, HUFFMAN_BLOCK_SIZE);
+            if(ferror(in))
+            {
+                rc = 1;
+                break;
+            }
+        }
+        if(job->len == 0)
+            break;
+
+        job->opts = opts;
+        pthread_mutex_lock(&pool.lock);
+        job->done = 0;
+        ++pool.queued;
+        pthread_cond_signal(&pool.queued_cond);
+        pthread_mutex_unlock(&pool.lock);
+
+        if(job->len < HUFFMAN_BLOCK_SIZE)
+            break;
+    }
+
+    /* Write out what is still queued. */
+    while(rc == 0 && written < pool.queued)
+        rc = write_slot(&pool, written++, out);
+
+    if(rc == 0)
+        rc = write_stream_end(out, &pool.ix);
+
+    /* Let the workers finish what they have and exit. */
+    if(nstarted > 0)
+    {
+        pthread_mutex_lock(&pool.lock);
+        pool.stop = 1;
+        pthread_cond_broadcast(&pool.queued_cond);
+        pthread_mutex_unlock(&pool.lock);
+        for(i = 0; i < nstarted; ++i)
+            pthread_join(threads[i], NULL);
+    }
+
+    if(ismapped && unmap_input(in, &m, mapped))
+        rc = 1;
+
+    free_pool(&pool);
+    return rc;
+}
+
+#define DECODE_CHUNK 65536
+
+static int
+write_run(FILE *out, unsigned char *outbuf, unsigned char symbol, uint64_t count)
+{
+    memset(outbuf, symbol, DECODE_CHUNK);
+    while(count > 0)
+    {
+        size_t n = count < DECODE_CHUNK ? (size_t)count : DECODE_CHUNK;
+        if(write_output(outbuf, n, out) != n)
+            return 1;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * write_raw_block writes the decoded bytes of a stored or run block
+ * whose payload is at buf to out.
+ */
+static int
+write_raw_block(FILE *out,
+                unsigned char *outbuf,
+                const block_header *h,
+                const unsigned char *buf)
+{
+    if(h->type == HUFFMAN_BLOCK_RUN)
+        return write_run(out, outbuf, buf[0], h->rawlen);
+    return write_output(buf, (size_t)h->rawlen, out) != h->rawlen;
+}
+
+/*
+ * decode_file_bits decodes count symbols from the code bits left in
+ * br, which reads from inbuf, followed by at most *plimit more bytes
+ * of in. *plimit is reduced by the number of bytes read.
+ */
+static int
+decode_file_bits(FILE *in,
+                 FILE *out,
+                 const huffman_decoder *dec,
+                 bit_reader *br,
+                 unsigned char *inbuf,
+                 unsigned char *outbuf,
+                 uint64_t count,
+                 uint64_t *plimit)
+{
+    while(count > 0)
+    {
+        size_t done = 0;
+        double t;
+        int rc;
+
+        /* Slide the unread bytes down and append more input. */
+        if(!br->final && br->end - br->cur < 8)
+        {
+            size_t left = br->end - br->cur;
+            size_t want = DECODE_CHUNK - left;
+            size_t got;
+
+            if(want > *plimit)
+                want = (size_t)*plimit;
+            memmove(inbuf, br->cur, left);
+            got = read_input(inbuf + left, want, in);
+            if(got == 0 && ferror(in))
+                return 1;
+            *plimit -= got;
+            br->cur = inbuf;
+            br->end = inbuf + left + got;
+            br->final = got == 0 || *plimit == 0;
+        }
+
+        t = stats_clock();
+        rc = decode_symbols(dec, br, outbuf,
+                            count < DECODE_CHUNK ? (size_t)count : DECODE_CHUNK,
+                            &done);
+        add_phase(HUFFMAN_PHASE_DECODE, t, done);
+        if(done > 0 && write_output(outbuf, done, out) != done)
+            return 1;
+        if(rc)
+            return 1;
+        count -= done;
+    }
+
+    return 0;
+}
+
+static int
+skip_bytes(FILE *in, unsigned char *buf, uint64_t count)
+{
+    while(count > 0)
+    {
+        size_t want = count < DECODE_CHUNK ? (size_t)count : DECODE_CHUNK;
+        if(read_input(buf, want, in) != want)
+            return 1;
+        count -= want;
+    }
+
+    return 0;
+}
+
+static int
+decode_file_v1(FILE *in,
+               FILE *out,
+               uint32_t count,
+               unsigned char *inbuf,
+               unsigned char *outbuf)
+{
+    huffman_tree tree;
+    huffman_decoder dec;
+    bit_reader br;
+    unsigned int data_count = 0;
+    uint64_t limit = UINT64_MAX;
+    int rc;
+
+    /* Read the Huffman code table. */
+    if (!read_code_table(in, count, &tree, &data_count))
+    {
+        return 1;
+    }
+
+    if (data_count == 0) {
+        return 0;
+    }
+
+    if (tree.nodes[0].isLeaf) {
+        return write_run(out, outbuf, tree.nodes[0].symbol, data_count);
+    }
+
+    // This is a multi-symbol, non-empty file.
+    init_decoder(&dec);
+    rc = build_decoder_from_tree(&dec, &tree);
+    if (rc)
+    {
+        return 1;
+    }
+
+    init_bit_reader(&br, inbuf, 0, 0);
+    rc = decode_file_bits(in, out, &dec, &br, inbuf, outbuf,
+                          data_count, &limit);
+    free_decoder(&dec);
+    return rc;
+}
+
+static int
+decode_file_v2(FILE *in,
+               FILE *out,
+               unsigned char *inbuf,
+               unsigned char *outbuf)
+{
+    for(;;)
+    {
+        unsigned char lens[MAX_SYMBOLS];
+        huffman_decoder dec;
+        bit_reader br;
+        block_header h;
+        unsigned int nsyms;
+        size_t got, pos = 0;
+        uint64_t limit;
+        int c, rc;
+
+        if((c = read_byte(in)) == EOF)
+            return 1;
+        if(is_stream_end((unsigned char)c))
+            return 0;
+
+        h.type = (unsigned char)c;
+        if(!is_data_block(h.type)
+           || fget_varint(in, &h.rawlen)
+           || fget_varint(in, &h.paylen)
+           || bad_block_size(h.type, h.rawlen, h.paylen))
+            return 1;
+
+        if(is_raw_block(h.type))
+        {
+            if(read_input(inbuf, (size_t)h.paylen, in) != h.paylen
+               || write_raw_block(out, outbuf, &h, inbuf))
+                return 1;
+            continue;
+        }
+
+        /* The code lengths come first; the rest of what is read
+           here is the start of the code bits. */
+        got = h.paylen < DECODE_CHUNK ? (size_t)h.paylen : DECODE_CHUNK;
+        if(read_input(inbuf, got, in) != got
+           || unpack_code_lengths(inbuf, got, &pos, lens, &nsyms))
+            return 1;
+        limit = h.paylen - got;
+
+        if(h.rawlen > 0 && nsyms == 1)
+        {
+            rc = write_run(out, outbuf, lone_symbol(lens), h.rawlen);
+        }
+        else if(h.rawlen > 0 && h.type == HUFFMAN_BLOCK_STREAMS)
+        {
+            /* The streams are decoded together, so the whole block is
+               read in; both buffers are big enough for one. */
+            init_decoder(&dec);
+            rc = read_input(inbuf + got, (size_t)limit, in) != limit
+                 || build_decoder_from_lengths(&dec, lens)
+                 || decode_streams(&dec, inbuf + pos, h.paylen - pos,
+                                   h.rawlen, outbuf, h.rawlen)
+                 || write_output(outbuf, (size_t)h.rawlen, out) != h.rawlen;
+            free_decoder(&dec);
+            limit = 0;
+        }
+        else if(h.rawlen > 0)
+        {
+            init_decoder(&dec);
+            if(build_decoder_from_lengths(&dec, lens))
+                return 1;
+            init_bit_reader(&br, inbuf + pos, got - pos, limit == 0);
+            rc = decode_file_bits(in, out, &dec, &br, inbuf, outbuf,
+                                  h.rawlen, &limit);
+            free_decoder(&dec);
+        }
+        else
+        {
+            rc = 0;
+        }
+
+        /* Skip whatever is left of the payload. */
+        if(rc || skip_bytes(in, inbuf, limit))
+            return 1;
+    }
+}
+
+/*
+ * decode_file_stream decodes a stream of either version read through
+ * stdio, for input that can't be mapped.
+ */
+static int
+decode_file_stream(FILE *in, FILE *out)
+{
+    unsigned char magic[HUFFMAN_MAGIC_LEN];
+    unsigned char *inbuf, *outbuf;
+    uint32_t count;
+    int rc;
+
+    if(read_input(magic, sizeof(magic), in) != sizeof(magic))
+        return 1;
+
+    inbuf = (unsigned char*)counted_malloc(MAX_STREAMS_PAYLOAD);
+    outbuf = (unsigned char*)counted_malloc(HUFFMAN_BLOCK_SIZE);
+    if(!inbuf || !outbuf)
+    {
+        free(inbuf);
+        free(outbuf);
+        return 1;
+    }
+
+    if(memcmp(magic, huffman_magic, HUFFMAN_MAGIC_LEN) == 0)
+    {
+        rc = decode_file_v2(in, out, inbuf, outbuf);
+    }
+    else
+    {
+        /* A version 1 stream; the magic was its entry count. */
+        memcpy(&count, magic, sizeof(count));
+        rc = decode_file_v1(in, out, ntohl(count), inbuf, outbuf);
+    }
+
+    free(inbuf);
+    free(outbuf);
+    return rc;
+}
+
+/*
+ * decode_mapped_v2 decodes the version 2 stream in the len bytes at
+ * buf, storing in *pused where the stream ended.
+ */
+static int
+decode_mapped_v2(FILE *in,
+                 FILE *out,
+                 const unsigned char *buf,
+                 size_t len,
+                 unsigned char *outbuf,
+                 size_t *pused)
+{
+    size_t pos = HUFFMAN_MAGIC_LEN;
+
+    for(;;)
+    {
+        unsigned char lens[MAX_SYMBOLS];
+        huffman_decoder dec;
+        bit_reader br;
+        block_header h;
+        unsigned int nsyms;
+        size_t lpos = 0;
+        uint64_t limit = 0;
+        int rc = 0;
+
+        if(read_block_header(buf, len, &pos, &h))
+            return 1;
+        if(is_stream_end(h.type))
+        {
+            *pused = pos;
+            return 0;
+        }
+
+        if(is_raw_block(h.type))
+        {
+            if(write_raw_block(out, outbuf, &h, buf + pos))
+                return 1;
+            pos += h.paylen;
+            continue;
+        }
+
+        if(unpack_code_lengths(buf + pos, h.paylen, &lpos, lens, &nsyms))
+            return 1;
+
+        if(h.rawlen > 0 && nsyms == 1)
+        {
+            rc = write_run(out, outbuf, lone_symbol(lens), h.rawlen);
+        }
+        else if(h.rawlen > 0 && h.type == HUFFMAN_BLOCK_STREAMS)
+        {
+            init_decoder(&dec);
+            rc = build_decoder_from_lengths(&dec, lens)
+                 || decode_streams(&dec, buf + pos + lpos, h.paylen - lpos,
+                                   h.rawlen, outbuf, h.rawlen)
+                 || write_output(outbuf, (size_t)h.rawlen, out) != h.rawlen;
+            free_decoder(&dec);
+        }
+        else if(h.rawlen > 0)
+        {
+            /* The whole payload is mapped, so the reader is final and
+               decode_file_bits never reads from in. */
+            init_decoder(&dec);
+            if(build_decoder_from_lengths(&dec, lens))
+                return 1;
+            init_bit_reader(&br, buf + pos + lpos, h.paylen - lpos, 1);
+            rc = decode_file_bits(in, out, &dec, &br, NULL, outbuf,
+                                  h.rawlen, &limit);
+            free_decoder(&dec);
+        }
+
+        if(rc)
+            return 1;
+        pos += h.paylen;
+    }
+}
+
+int
+huffman_decode_file(FILE *in, FILE *out)
+{
+    unsigned char *outbuf;
+    mapped_input m;
+    int rc;
+
+    if(map_input(in, &m, POSIX_MADV_SEQUENTIAL) == 0)
+    {
+        size_t used = 0;
+
+        /* Version 1 streams are left to the stdio path below. */
+        if(m.len < HUFFMAN_MAGIC_LEN
+           || memcmp(m.data, huffman_magic, HUFFMAN_MAGIC_LEN) != 0)
+            return unmap_input(in, &m, 0) || decode_file_stream(in, out);
+
+        outbuf = (unsigned char*)counted_malloc(HUFFMAN_BLOCK_SIZE);
+        rc = !outbuf
+             || decode_mapped_v2(in, out, m.data, m.len, outbuf, &used);
+        free(outbuf);
+        return unmap_input(in, &m, used) || rc;
+    }
+
+    return decode_file_stream(in, out);
+}
+
+
+#define CACHE_SIZE 4096
+
+static int
+encode_memory(const unsigned char *bufin,
+              size_t bufinlen,
+              unsigned char **pbufout,
+              size_t *pbufoutlen,
+              const huffman_options *opts)
+{
+    unsigned char *end;
+    size_t endlen;
+    size_t i;
+    int rc = 0;
+    block_index ix;
+    buf_cache cache;
+
+    /* Ensure the arguments are valid. */
+    if(!pbufout || !pbufoutlen)
+        return 1;
+
+    if(init_cache(&cache, CACHE_SIZE, pbufout, pbufoutlen))
+        return 1;
+
+    memset(&ix, 0, sizeof(ix));
+    rc = write_cache(&cache, huffman_magic, HUFFMAN_MAGIC_LEN);
+
+    for(i = 0; rc == 0 && i < bufinlen; i += HUFFMAN_BLOCK_SIZE)
+    {
+        size_t len = bufinlen - i < HUFFMAN_BLOCK_SIZE
+                     ? bufinlen - i : HUFFMAN_BLOCK_SIZE;
+        size_t room = MAX_BLOCK_HEADER + block_code_bound(len), size = 0;
+        unsigned char *block = reserve_cache(&cache, room);
+
+        rc = !block
+             || encode_block_in_place(bufin + i, len, opts, block, &size);
+        if(rc == 0)
+        {
+            unreserve_cache(&cache, room - size);
+            rc = add_index_entry(&ix, size, len);
+        }
+    }
+
+    if(rc == 0)
+    {
+        end = pack_stream_end(&ix, &endlen);
+        rc = !end || write_cache(&cache, end, endlen);
+        free(end);
+    }
+    free_index(&ix);
+
+    /* Trim the output to size. */
+    if(rc == 0)
+        rc = flush_cache(&cache);
+
+    if(rc)
+        free_cache(&cache);
+    return rc;
+}
+
+/*
+ * put_walked_stream_end writes the end of a stream whose nblocks
+ * blocks are in out up to offset end, and returns its length, or 0
+ * if it won't fit in outcap. The index entries are read back from the
+ * block headers, so none need to be kept while encoding.
+ */
+static size_t
+put_walked_stream_end(unsigned char *out,
+                      size_t end,
+                      size_t outcap,
+                      size_t nblocks)
+{
+    size_t n, pos, need = 1;
+    block_header h;
+
+    if(nblocks >= 2)
+    {
+        need += varint_len(nblocks) + HUFFMAN_TRAILER_LEN;
+        for(pos = HUFFMAN_MAGIC_LEN; pos < end; pos += h.paylen)
+        {
+            size_t start = pos;
+
+            read_block_header(out, end, &pos, &h);
+            need += varint_len(pos + h.paylen - start) + varint_len(h.rawlen);
+        }
+    }
+
+    if(need > outcap - end)
+        return 0;
+
+    if(nblocks < 2)
+    {
+        out[end] = HUFFMAN_BLOCK_END;
+        return 1;
+    }
+
+    n = end;
+    out[n++] = HUFFMAN_BLOCK_INDEX;
+    n += put_varint(out + n, nblocks);
+    for(pos = HUFFMAN_MAGIC_LEN; pos < end; pos += h.paylen)
+    {
+        size_t start = pos;
+
+        read_block_header(out, end, &pos, &h);
+        n += put_varint(out + n, pos + h.paylen - start);
+        n += put_varint(out + n, h.rawlen);
+    }
+
+    store_le64(out + n, n - end);
+    memcpy(out + n + 8, huffman_index_magic, HUFFMAN_MAGIC_LEN);
+    return need;
+}
+
+/*
+ * encode_into encodes into the outcap bytes at out without allocating
+ * anything, failing if they aren't enough.
+ */
+static int
+encode_into(const unsigned char *bufin,
+            size_t bufinlen,
+            unsigned char *out,
+            size_t outcap,
+            size_t *poutlen,
+            const huffman_options *opts)
+{
+    huffman_codeword table[MAX_SYMBOLS];
+    size_t i, endlen, pos = HUFFMAN_MAGIC_LEN, nblocks = 0;
+
+    if(!out || !poutlen || outcap < HUFFMAN_MAGIC_LEN)
+        return 1;
+
+    memcpy(out, huffman_magic, HUFFMAN_MAGIC_LEN);
+
+    for(i = 0; i < bufinlen; i += HUFFMAN_BLOCK_SIZE)
+    {
+        size_t len = bufinlen - i < HUFFMAN_BLOCK_SIZE
+                     ? bufinlen - i : HUFFMAN_BLOCK_SIZE;
+        unsigned char header[MAX_BLOCK_HEADER];
+        unsigned int headerlen = 0;
+        uint64_t codebytes = 0;
+
+        /* A sampled block's size is only known once it is coded. */
+        if(is_sampled(len, opts))
+        {
+            size_t size;
+
+            if(MAX_BLOCK_HEADER + block_code_bound(len) > outcap - pos
+               || encode_block_in_place(bufin + i, len, opts, out + pos,
+                                        &size))
+                return 1;
+            pos += size;
+            ++nblocks;
+            continue;
+        }
+
+        if(prepare_block(bufin + i, len, opts, table, header,
+                         &headerlen, &codebytes)
+           || headerlen + codebytes > outcap - pos)
+            return 1;
+
+        memcpy(out + pos, header, headerlen);
+        encode_payload(out + pos + headerlen, bufin + i, len, header, table,
+                       opts);
+        pos += headerlen + codebytes;
+        ++nblocks;
+    }
+
+    endlen = put_walked_stream_end(out, pos, outcap, nblocks);
+    if(endlen == 0)
+        return 1;
+
+    *poutlen = pos + endlen;
+    return 0;
+}
+
+int huffman_encode_memory(const unsigned char *bufin,
+                          uint32_t bufinlen,
+                          unsigned char **pbufout,
+                          uint32_t *pbufoutlen)
+{
+    size_t len;
+
+    if(!pbufout || !pbufoutlen
+       || huffman_encode_memory64(bufin, bufinlen, pbufout, &len))
+        return 1;
+
+    /* The output may outgrow a 32-bit length on incompressible input. */
+    if(len > UINT32_MAX)
+    {
+        free(*pbufout);
+        *pbufout = NULL;
+        return 1;
+    }
+
+    *pbufoutlen = (uint32_t)len;
+    return 0;
+}
+
+/*
+ * decode_into_v2 decodes the blocks of the version 2 stream in bufin
+ * straight into out.
+ */
+static int
+decode_into_v2(huffman_decoder *dec,
+               const unsigned char *bufin,
+               size_t bufinlen,
+               unsigned char *out,
+               size_t outcap,
+               size_t *poutlen)
+{
+    block_header h;
+    size_t pos = HUFFMAN_MAGIC_LEN, total = 0;
+
+    for(;;)
+    {
+        if(read_block_header(bufin, bufinlen, &pos, &h))
+            return 1;
+        if(is_stream_end(h.type))
+            break;
+
+        if(h.rawlen > outcap - total
+           || decode_block_with(dec, bufin + pos, &h, out + total, h.rawlen))
+            return 1;
+        total += (size_t)h.rawlen;
+        pos += h.paylen;
+    }
+
+    *poutlen = total;
+    return 0;
+}
+
+/*
+ * decode_into_v1 decodes the version 1 stream in bufin into out.
+ */
+static int
+decode_into_v1(huffman_decoder *dec,
+               const unsigned char *bufin,
+               size_t bufinlen,
+               unsigned char *out,
+               size_t outcap,
+               size_t *poutlen)
+{
+    huffman_tree tree;
+    bit_reader br;
+    uint32_t data_count;
+    size_t i = 0, done = 0;
+    int rc = 0;
+
+    /* Read the Huffman code table. */
+    if(read_code_table_from_memory(bufin, bufinlen, &i, &tree, &data_count)
+       || data_count > outcap)
+        return 1;
+
+    if(tree.nodes[0].isLeaf)
+    {
+        /* A single symbol table encodes a run of that symbol. */
+        memset(out, tree.nodes[0].symbol, data_count);
+        done = data_count;
+    }
+    else if(data_count > 0)
+    {
+        /* Decode the memory. */
+        rc = build_decoder_from_tree(dec, &tree);
+        if(rc == 0)
+        {
+            init_bit_reader(&br, bufin + i, bufinlen - i, 1);
+            rc = decode_symbols(dec, &br, out, data_count, &done);
+        }
+    }
+
+    if(rc)
+        return 1;
+
+    *poutlen = done;
+    return 0;
+}
+
+int
+huffman_decoded_size(const unsigned char *bufin,
+                     size_t bufinlen,
+                     uint64_t *psize)
+{
+    uint32_t count, data_count;
+
+    if(!bufin || !psize)
+        return 1;
+
+    if(bufinlen >= HUFFMAN_MAGIC_LEN
+       && memcmp(bufin, huffman_magic, HUFFMAN_MAGIC_LEN) == 0)
+    {
+        /* Add up the block headers, skipping the payloads. */
+        block_header h;
+        size_t pos = HUFFMAN_MAGIC_LEN;
+        uint64_t total = 0;
+
+        for(;;)
+        {
+            if(read_block_header(bufin, bufinlen, &pos, &h))
+                return 1;
+            if(is_stream_end(h.type))
+                break;
+            if(h.rawlen > UINT64_MAX - total)
+                return 1;
+            total += h.rawlen;
+            pos += h.paylen;
+        }
+
+        *psize = total;
+        return 0;
+    }
+
+    /* A version 1 header is the entry count and the data size, both
+       in network byte order. */
+    if(bufinlen < sizeof(count) + sizeof(data_count))
+        return 1;
+
+    memcpy(&count, bufin, sizeof(count));
+    memcpy(&data_count, bufin + sizeof(count), sizeof(data_count));
+    count = ntohl(count);
+    data_count = ntohl(data_count);
+    if(count > MAX_SYMBOLS || (count == 0 && data_count > 0))
+        return 1;
+
+    *psize = data_count;
+    return 0;
+}
+
+/*
+ * decode_into decodes bufin into out with the table storage of dec.
+ */
+static int
+decode_into(huffman_decoder *dec,
+            const unsigned char *bufin,
+            size_t bufinlen,
+            unsigned char *out,
+            size_t outcap,
+            size_t *poutlen)
+{
+    if(!bufin || !poutlen || (!out && outcap > 0))
+        return 1;
+
+    if(bufinlen >= HUFFMAN_MAGIC_LEN
+       && memcmp(bufin, huffman_magic, HUFFMAN_MAGIC_LEN) == 0)
+        return decode_into_v2(dec, bufin, bufinlen, out, outcap, poutlen);
+
+    return decode_into_v1(dec, bufin, bufinlen, out, outcap, poutlen);
+}
+
+int
+huffman_decode_into(const unsigned char *bufin,
+                    size_t bufinlen,
+                    unsigned char *out,
+                    size_t outcap,
+                    size_t *poutlen)
+{
+    huffman_decoder dec;
+    int rc;
+
+    init_decoder(&dec);
+    rc = decode_into(&dec, bufin, bufinlen, out, outcap, poutlen);
+    free_decoder(&dec);
+    return rc;
+}
+
+int huffman_decode_memory64(const unsigned char *bufin,
+                            size_t bufinlen,
+                            unsigned char **pbufout,
+                            size_t *pbufoutlen)
+{
+    unsigned char *buf;
+    uint64_t size;
+
+    /* Ensure the arguments are valid. */
+    if(!pbufout || !pbufoutlen)
+        return 1;
+
+    if(huffman_decoded_size(bufin, bufinlen, &size) || size > SIZE_MAX)
+        return 1;
+
+    buf = (unsigned char*)counted_malloc(size ? (size_t)size : 1);
+    if(!buf)
+        return 1;
+
+    if(huffman_decode_into(bufin, bufinlen, buf, (size_t)size, pbufoutlen))
+    {
+        free(buf);
+        return 1;
+    }
+
+    *pbufout = buf;
+    return 0;
+}
+
+int huffman_decode_memory(const unsigned char *bufin,
+                          uint32_t bufinlen,
+                          unsigned char **pbufout,
+                          uint32_t *pbufoutlen)
+{
+    size_t len;
+
+    if(!pbufout || !pbufoutlen
+       || huffman_decode_memory64(bufin, bufinlen, pbufout, &len))
+        return 1;
+
+    if(len > UINT32_MAX)
+    {
+        free(*pbufout);
+        *pbufout = NULL;
+        return 1;
+    }
+
+    *pbufoutlen = (uint32_t)len;
+    return 0;
+}
+
+/*
+ * Block-parallel decoding.
+ *
+ * The index, or failing that a walk over the block headers, gives
+ * every block's place in both the stream and the decoded data, so
+ * blocks can be decoded on separate threads straight into place.
+ */
+typedef struct decode_job_tag
+{
+    const unsigned char *in;
+    const block_entry *entry;
+    unsigned char *out;
+    /* For the file path: the descriptors to read and write at the
+       given bases, or -1 to leave the result in out. */
+    int infd;
+    int outfd;
+    off_t inbase;
+    off_t outbase;
+    unsigned char *inbuf;
+    int rc;
+} decode_job;
+
+/*
+ * decode_entry decodes the first count bytes of the block described
+ * by e, whose header and payload are at in, into out.
+ */
+static int
+decode_entry(const unsigned char *in,
+             const block_entry *e,
+             unsigned char *out,
+             uint64_t count)
+{
+    block_header h;
+    size_t pos = 0;
+
+    if(read_block_header(in, e->complen, &pos, &h)
+       || is_stream_end(h.type)
+       || pos + h.paylen != e->complen
+       || h.rawlen != e->rawlen)
+        return 1;
+
+    return decode_block(in + pos, &h, out, count);
+}
+
+static void
+decode_memory_job(void *arg)
+{
+    decode_job *job = (decode_job*)arg;
+
+    job->rc = decode_entry(job->in, job->entry, job->out, job->entry->rawlen);
+}
+
+int
+huffman_decode_memory_mt(const unsigned char *bufin,
+                         size_t bufinlen,
+                         unsigned char **pbufout,
+                         size_t *pbufoutlen,
+                         unsigned int nthreads)
+{
+    block_index ix;
+    decode_job *jobs;
+    unsigned char *buf;
+    uint64_t total = 0;
+    size_t i;
+    int rc = 0;
+
+    /* Ensure the arguments are valid. */
+    if(!pbufout || !pbufoutlen)
+        return 1;
+
+    if(bufinlen < HUFFMAN_MAGIC_LEN
+       || memcmp(bufin, huffman_magic, HUFFMAN_MAGIC_LEN) != 0)
+    {
+        /* Version 1 streams are a single serial bit stream. */
+        return huffman_decode_memory64(bufin, bufinlen, pbufout, pbufoutlen);
+    }
+
+    if(list_blocks(bufin, bufinlen, &ix))
+        return 1;
+
+    for(i = 0; i < ix.n; ++i)
+    {
+        if(ix.entries[i].offset + ix.entries[i].complen > bufinlen)
+            rc = 1;
+        total += ix.entries[i].rawlen;
+    }
+
+    jobs = (decode_job*)counted_calloc(ix.n ? ix.n : 1, sizeof(decode_job));
+    buf = rc == 0 && total <= SIZE_MAX
+          ? (unsigned char*)counted_malloc(total ? (size_t)total : 1) : NULL;
+    if(!jobs || !buf)
+    {
+        free(jobs);
+        free(buf);
+        free_index(&ix);
+        return 1;
+    }
+
+    for(i = 0; i < ix.n; ++i)
+    {
+        jobs[i].in = bufin + ix.entries[i].offset;
+        jobs[i].entry = &ix.entries[i];
+        jobs[i].out = buf + ix.entries[i].rawoffset;
+    }
+
+    rc = run_parallel(jobs, ix.n, sizeof(decode_job), clamp_threads(nthreads),
+                      decode_memory_job);
+    for(i = 0; i < ix.n; ++i)
+        rc |= jobs[i].rc;
+
+    free(jobs);
+    free_index(&ix);
+    if(rc)
+    {
+        free(buf);
+        return 1;
+    }
+
+    *pbufout = buf;
+    *pbufoutlen = (size_t)total;
+    return 0;
+}
+
+static int
+pread_full(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    double t = stats_clock();
+    size_t total = len;
+
+    while(len > 0)
+    {
+        ssize_t n = pread(fd, buf, len, offset);
+        if(n <= 0)
+            return 1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+
+    add_phase(HUFFMAN_PHASE_READ, t, total);
+    return 0;
+}
+
+static int
+pwrite_full(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+    double t = stats_clock();
+    size_t total = len;
+
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if(n <= 0)
+            return 1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+
+    add_phase(HUFFMAN_PHASE_WRITE, t, total);
+    return 0;
+}
+
+static void
+decode_file_job(void *arg)
+{
+    decode_job *job = (decode_job*)arg;
+    const block_entry *e = job->entry;
+
+    job->rc = 1;
+    job->out = (unsigned char*)counted_malloc(e->rawlen ? e->rawlen : 1);
+    if(!job->out)
+        return;
+
+    /* A mapped input is decoded in place, anything else is read. */
+    if(job->in)
+    {
+        if(decode_entry(job->in + e->offset, e, job->out, e->rawlen))
+            return;
+    }
+    else
+    {
+        job->inbuf = (unsigned char*)counted_malloc(e->complen);
+        if(!job->inbuf
+           || pread_full(job->infd, job->inbuf, e->complen,
+                         job->inbase + (off_t)e->offset)
+           || decode_entry(job->inbuf, e, job->out, e->rawlen))
+            return;
+    }
+
+    free(job->inbuf);
+    job->inbuf = NULL;
+    if(job->outfd >= 0)
+    {
+        job->rc = pwrite_full(job->outfd, job->out, e->rawlen,
+                              job->outbase + (off_t)e->rawoffset);
+        free(job->out);
+        job->out = NULL;
+        return;
+    }
+
+    job->rc = 0;
+}
+
+/*
+ * load_file_index reads the index of the stream that starts at offset
+ * start of in and runs to the end of the file.
+ */
+static int
+load_file_index(FILE *in, off_t start, block_index *ix, off_t *pend)
+{
+    unsigned char magic[HUFFMAN_MAGIC_LEN];
+    unsigned char trailer[HUFFMAN_TRAILER_LEN];
+    unsigned char *buf;
+    uint64_t indexpos;
+    off_t end;
+    int rc;
+
+    if(fseeko(in, 0, SEEK_END) || (end = ftello(in)) < start
+       || pread_full(fileno(in), magic, HUFFMAN_MAGIC_LEN, start)
+       || memcmp(magic, huffman_magic, HUFFMAN_MAGIC_LEN) != 0
+       || end - start < HUFFMAN_TRAILER_LEN
+       || pread_full(fileno(in), trailer, HUFFMAN_TRAILER_LEN,
+                     end - HUFFMAN_TRAILER_LEN))
+        return 1;
+
+    indexpos = index_position(trailer, end - start);
+    if(indexpos == 0)
+        return 1;
+
+    buf = (unsigned char*)counted_malloc(end - start - indexpos);
+    rc = !buf
+         || pread_full(fileno(in), buf, end - start - indexpos,
+                       start + (off_t)indexpos)
+         || parse_index(buf, end - start - indexpos, indexpos, ix);
+    free(buf);
+    *pend = end;
+    return rc;
+}
+
+int
+huffman_decode_file_mt(FILE *in, FILE *out, unsigned int nthreads)
+{
+    block_index ix;
+    decode_job *jobs;
+    struct stat st;
+    mapped_input m;
+    off_t start, end, outbase = -1;
+    size_t i, batch;
+    uint64_t total = 0;
+    int ismapped, rc = 0;
+
+    nthreads = clamp_threads(nthreads);
+    start = ftello(in);
+
+    /* Without random access to an indexed stream, decode serially. */
+    if(nthreads == 1 || start < 0 || load_file_index(in, start, &ix, &end))
+    {
+        if(start >= 0 && fseeko(in, start, SEEK_SET))
+            return 1;
+        return huffman_decode_file(in, out);
+    }
+
+    if(fseeko(in, start, SEEK_SET))
+    {
+        free_index(&ix);
+        return 1;
+    }
+    ismapped = map_input(in, &m, POSIX_MADV_WILLNEED) == 0;
+
+    /* Blocks go straight to their place in a regular output file;
+       anything else gets them in order from this thread. */
+    if(fflush(out) == 0 && fstat(fileno(out), &st) == 0
+       && S_ISREG(st.st_mode))
+        outbase = ftello(out);
+
+    batch = outbase >= 0 ? ix.n : 4 * (size_t)nthreads;
+    jobs = (decode_job*)counted_calloc(batch ? batch : 1, sizeof(decode_job));
+    if(!jobs)
+    {
+        free_index(&ix);
+        return 1;
+    }
+
+    for(i = 0; rc == 0 && i < ix.n; i += batch)
+    {
+        size_t j, n = ix.n - i < batch ? ix.n - i : batch;
+
+        for(j = 0; j < n; ++j)
+        {
+            memset(&jobs[j], 0, sizeof(decode_job));
+            jobs[j].entry = &ix.entries[i + j];
+            jobs[j].in = ismapped ? m.data : NULL;
+            jobs[j].infd = fileno(in);
+            jobs[j].inbase = start;
+            jobs[j].outfd = outbase >= 0 ? fileno(out) : -1;
+            jobs[j].outbase = outbase;
+        }
+
+        rc = run_parallel(jobs, n, sizeof(decode_job), nthreads,
+                          decode_file_job);
+
+        for(j = 0; j < n; ++j)
+        {
+            const block_entry *e = jobs[j].entry;
+
+            rc |= jobs[j].rc;
+            if(rc == 0 && outbase < 0
+               && write_output(jobs[j].out, e->rawlen, out) != e->rawlen)
+                rc = 1;
+            total += e->rawlen;
+            free(jobs[j].inbuf);
+            free(jobs[j].out);
+        }
+    }
+
+    /* Leave both streams positioned after what was processed. */
+    if(ismapped)
+        munmap(m.base, m.maplen);
+    if(rc == 0 && outbase >= 0 && fseeko(out, outbase + (off_t)total, SEEK_SET))
+        rc = 1;
+    if(rc == 0 && fseeko(in, end, SEEK_SET))
+        rc = 1;
+
+    free(jobs);
+    free_index(&ix);
+    return rc;
+}
+
+/*
+ * Range decoding.
+ *
+ * Only the blocks that overlap the range are decoded. A block's codes
+ * can't be entered part way, so the leading block is decoded from its
+ * start up to the end of the range and the part before it dropped.
+ */
+typedef struct range_state_tag
+{
+    uint64_t offset;
+    size_t len;
+    unsigned char *out;
+    unsigned char *tmp;
+    size_t tmpcap;
+} range_state;
+
+/*
+ * first_entry returns the index of the block holding decoded byte
+ * offset, or ix->n if there is none.
+ */
+static size_t
+first_entry(const block_index *ix, uint64_t offset)
+{
+    size_t lo = 0, hi = ix->n;
+
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const block_entry *e = &ix->entries[mid];
+
+        if(offset >= e->rawoffset + e->rawlen)
+            lo = mid + 1;
+        else if(offset < e->rawoffset)
+            hi = mid;
+        else
+            return mid;
+    }
+
+    return ix->n;
+}
+
+/*
+ * decode_range_entry decodes the part of the range that falls in the
+ * block described by e, whose bytes are at in.
+ */
+static int
+decode_range_entry(range_state *rs,
+                   const unsigned char *in,
+                   const block_entry *e)
+{
+    uint64_t start = rs->offset > e->rawoffset ? rs->offset - e->rawoffset : 0;
+    uint64_t stop = rs->offset + rs->len - e->rawoffset;
+    unsigned char *dst = rs->out + (e->rawoffset + start - rs->offset);
+
+    if(stop > e->rawlen)
+        stop = e->rawlen;
+
+    if(start == 0)
+        return decode_entry(in, e, dst, stop);
+
+    if(stop > rs->tmpcap)
+    {
+        unsigned char *tmp = (unsigned char*)counted_realloc(rs->tmp, stop);
+        if(!tmp)
+            return 1;
+        rs->tmp = tmp;
+        rs->tmpcap = stop;
+    }
+
+    if(decode_entry(in, e, rs->tmp, stop))
+        return 1;
+    memcpy(dst, rs->tmp + start, stop - start);
+    return 0;
+}
+
+int
+huffman_decode_range(const unsigned char *bufin,
+                     size_t bufinlen,
+                     uint64_t offset,
+                     size_t len,
+                     unsigned char *out)
+{
+    range_state rs;
+    block_index ix;
+    size_t i;
+    int rc = 0;
+
+    if(len == 0)
+        return 0;
+
+    if(bufinlen < HUFFMAN_MAGIC_LEN
+       || memcmp(bufin, huffman_magic, HUFFMAN_MAGIC_LEN) != 0)
+    {
+        /* Version 1 streams have to be decoded from the start. */
+        unsigned char *all = NULL;
+        size_t alllen = 0;
+
+        if(huffman_decode_memory64(bufin, bufinlen, &all, &alllen))
+            return 1;
+        rc = offset > alllen || len > alllen - offset;
+        if(rc == 0)
+            memcpy(out, all + offset, len);
+        free(all);
+        return rc;
+    }
+
+    if(list_blocks(bufin, bufinlen, &ix))
+        return 1;
+
+    memset(&rs, 0, sizeof(rs));
+    rs.offset = offset;
+    rs.len = len;
+    rs.out = out;
+
+    i = first_entry(&ix, offset);
+    if(i == ix.n
+       || ix.entries[ix.n - 1].rawoffset + ix.entries[ix.n - 1].rawlen
+          - offset < len)
+        rc = 1;
+
+    for(; rc == 0 && i < ix.n && ix.entries[i].rawoffset < offset + len; ++i)
+    {
+        const block_entry *e = &ix.entries[i];
+
+        if(e->offset + e->complen > bufinlen)
+            rc = 1;
+        else
+            rc = decode_range_entry(&rs, bufin + e->offset, e);
+    }
+
+    free(rs.tmp);
+    free_index(&ix);
+    return rc;
+}
+
+/*
+ * list_file_blocks finds the blocks of the stream that starts at
+ * offset start of in, from its index or else by reading each block
+ * header and seeking past the payload.
+ */
+static int
+list_file_blocks(FILE *in, off_t start, block_index *ix)
+{
+    unsigned char header[1 + 2 * MAX_VARINT_LEN];
+    off_t end, pos = start + HUFFMAN_MAGIC_LEN;
+
+    if(load_file_index(in, start, ix, &end) == 0)
+        return 0;
+
+    memset(ix, 0, sizeof(*ix));
+    for(;;)
+    {
+        ssize_t got = pread(fileno(in), header, sizeof(header), pos);
+        uint64_t rawlen, paylen;
+        size_t hpos = 1;
+
+        if(got <= 0)
+            break;
+        if(is_stream_end(header[0]))
+            return 0;
+
+        /* The header may run into the payload, so only it is parsed
+           here rather than checked against the bytes read. */
+        if(!is_data_block(header[0])
+           || get_varint(header, got, &hpos, &rawlen)
+           || get_varint(header, got, &hpos, &paylen)
+           || add_index_entry(ix, hpos + paylen, rawlen))
+            break;
+        pos += hpos + paylen;
+    }
+
+    free_index(ix);
+    return 1;
+}
+
+int
+huffman_decode_file_range(FILE *in,
+                          uint64_t offset,
+                          size_t len,
+                          unsigned char *out)
+{
+    unsigned char magic[HUFFMAN_MAGIC_LEN];
+    unsigned char *buf = NULL;
+    size_t bufcap = 0;
+    range_state rs;
+    block_index ix;
+    off_t start;
+    size_t i;
+    int rc = 0;
+
+    if(len == 0)
+        return 0;
+
+    start = ftello(in);
+    if(start < 0
+       || pread_full(fileno(in), magic, HUFFMAN_MAGIC_LEN, start)
+       || memcmp(magic, huffman_magic, HUFFMAN_MAGIC_LEN) != 0
+       || list_file_blocks(in, start, &ix))
+        return 1;
+
+    memset(&rs, 0, sizeof(rs));
+    rs.offset = offset;
+    rs.len = len;
+    rs.out = out;
+
+    i = first_entry(&ix, offset);
+    if(i == ix.n
+       || ix.entries[ix.n - 1].rawoffset + ix.entries[ix.n - 1].rawlen
+          - offset < len)
+        rc = 1;
+
+    for(; rc == 0 && i < ix.n && ix.entries[i].rawoffset < offset + len; ++i)
+    {
+        const block_entry *e = &ix.entries[i];
+
+        if(e->complen > bufcap)
+        {
+            unsigned char *tmp =
+                (unsigned char*)counted_realloc(buf, e->complen);
+            if(!tmp)
+            {
+                rc = 1;
+                break;
+            }
+            buf = tmp;
+            bufcap = e->complen;
+        }
+
+        rc = pread_full(fileno(in), buf, e->complen, start + (off_t)e->offset)
+             || decode_range_entry(&rs, buf, e);
+    }
+
+    free(buf);
+    free(rs.tmp);
+    free_index(&ix);
+    return fseeko(in, start, SEEK_SET) || rc;
+}
+
+/*
+ * Options.
+ *
+ * The plain and _mt encoders are the option-taking ones with the
+ * defaults and, for the latter, a thread count.
+ */
+void
+huffman_options_init(huffman_options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->max_code_length = HUFFMAN_MAX_CODE_LENGTH;
+    opts->threads = 1;
+    opts->streams = HUFFMAN_STREAMS;
+    opts->fast = 0;
+    opts->pipeline = 0;
+}
+
+/*
+ * check_options fills in the defaults for a missing opts and rejects
+ * a code length limit that can't hold every byte value or an
+ * unsupported stream count.
+ */
+static int
+check_options(const huffman_options *opts, huffman_options *out)
+{
+    if(opts)
+        *out = *opts;
+    else
+        huffman_options_init(out);
+
+    return out->max_code_length < HUFFMAN_MIN_CODE_LENGTH
+           || out->max_code_length > HUFFMAN_MAX_CODE_LENGTH
+           || (out->streams != 1 && out->streams != HUFFMAN_STREAMS);
+}
+
+/*
+ * code_file_pipelined encodes or decodes in to out on the calling
+ * thread with a pipeline doing the I/O.
+ */
+static int
+code_file_pipelined(FILE *in,
+                    FILE *out,
+                    const huffman_options *opts,
+                    int encode)
+{
+    file_pipeline p;
+    int rc;
+
+    if(start_pipeline(&p, in, out))
+        return 1;
+
+    rc = encode ? encode_file(in, out, opts) : huffman_decode_file(in, out);
+    return finish_pipeline(&p) || rc;
+}
+
+int
+huffman_encode_file_opts(FILE *in, FILE *out, const huffman_options *opts)
+{
+    huffman_options o;
+    double start = 0;
+    int started, rc;
+
+    if(check_options(opts, &o))
+        return 1;
+
+    started = start_stats(o.stats, &start);
+    if(o.threads > 1)
+        rc = encode_file_mt(in, out, o.threads, &o);
+    else if(o.pipeline)
+        rc = code_file_pipelined(in, out, &o, 1);
+    else
+        rc = encode_file(in, out, &o);
+    finish_stats(started, start);
+    return rc;
+}
+
+int
+huffman_encode_memory_opts(const unsigned char *bufin,
+                           size_t bufinlen,
+                           unsigned char **pbufout,
+                           size_t *pbufoutlen,
+                           const huffman_options *opts)
+{
+    huffman_options o;
+    double start = 0;
+    int started, rc;
+
+    if(check_options(opts, &o))
+        return 1;
+
+    started = start_stats(o.stats, &start);
+    rc = o.threads > 1
+         ? encode_memory_mt(bufin, bufinlen, pbufout, pbufoutlen,
+                            o.threads, &o)
+         : encode_memory(bufin, bufinlen, pbufout, pbufoutlen, &o);
+    finish_stats(started, start);
+    return rc;
+}
+
+int
+huffman_decode_file_opts(FILE *in, FILE *out, const huffman_options *opts)
+{
+    huffman_options o;
+    double start = 0;
+    int started, rc;
+
+    if(check_options(opts, &o))
+        return 1;
+
+    started = start_stats(o.stats, &start);
+    if(o.threads > 1)
+        rc = huffman_decode_file_mt(in, out, o.threads);
+    else if(o.pipeline)
+        rc = code_file_pipelined(in, out, &o, 0);
+    else
+        rc = huffman_decode_file(in, out);
+    finish_stats(started, start);
+    return rc;
+}
+
+int
+huffman_decode_memory_opts(const unsigned char *bufin,
+                           size_t bufinlen,
+                           unsigned char **pbufout,
+                           size_t *pbufoutlen,
+                           const huffman_options *opts)
+{
+    huffman_options o;
+    double start = 0;
+    int started, rc;
+
+    if(check_options(opts, &o))
+        return 1;
+
+    started = start_stats(o.stats, &start);
+    rc = o.threads > 1
+         ? huffman_decode_memory_mt(bufin, bufinlen, pbufout, pbufoutlen,
+                                    o.threads)
+         : huffman_decode_memory64(bufin, bufinlen, pbufout, pbufoutlen);
+    finish_stats(started, start);
+    return rc;
+}
+
+int
+huffman_encode_file(FILE *in, FILE *out)
+{
+    return huffman_encode_file_opts(in, out, NULL);
+}
+
+int
+huffman_encode_file_mt(FILE *in, FILE *out, unsigned int nthreads)
+{
+    huffman_options o;
+
+    huffman_options_init(&o);
+    o.threads = clamp_threads(nthreads);
+    return huffman_encode_file_opts(in, out, &o);
+}
+
+int
+huffman_encode_memory64(const unsigned char *bufin,
+                        size_t bufinlen,
+                        unsigned char **pbufout,
+                        size_t *pbufoutlen)
+{
+    return huffman_encode_memory_opts(bufin, bufinlen, pbufout, pbufoutlen,
+                                      NULL);
+}
+
+int
+huffman_encode_memory_mt(const unsigned char *bufin,
+                         size_t bufinlen,
+                         unsigned char **pbufout,
+                         size_t *pbufoutlen,
+                         unsigned int nthreads)
+{
+    huffman_options o;
+
+    huffman_options_init(&o);
+    o.threads = clamp_threads(nthreads);
+    return encode_memory_mt(bufin, bufinlen, pbufout, pbufoutlen,
+                            o.threads, &o);
+}
+
+int
+huffman_encode_into(const unsigned char *bufin,
+                    size_t bufinlen,
+                    unsigned char *out,
+                    size_t outcap,
+                    size_t *poutlen,
+                    const huffman_options *opts)
+{
+    huffman_options o;
+    double start = 0;
+    int started, rc;
+
+    if(check_options(opts, &o))
+        return 1;
+
+    started = start_stats(o.stats, &start);
+    rc = encode_into(bufin, bufinlen, out, outcap, poutlen, &o);
+    finish_stats(started, start);
+    return rc;
+}
+
+size_t
+huffman_encode_bound(size_t len)
+{
+    size_t nblocks = len / HUFFMAN_BLOCK_SIZE
+                     + (len % HUFFMAN_BLOCK_SIZE ? 1 : 0);
+    size_t overhead = HUFFMAN_MAGIC_LEN + 1 + MAX_VARINT_LEN
+                      + HUFFMAN_TRAILER_LEN
+                      + nblocks * (MAX_BLOCK_HEADER + 2 * MAX_VARINT_LEN
+                                   + HUFFMAN_STREAMS);
+
+    return len > SIZE_MAX - overhead ? 0 : len + overhead;
+}
+
+/*
+ * Reusable contexts.
+ *
+ * A context keeps its output buffer and, for decoding, its lookup
+ * table storage from one call to the next, so a stream of short
+ * messages doesn't pay for an allocation per message. Both buffers
+ * only ever grow.
+ */
+struct huffman_encoder_ctx
+{
+    huffman_options opts;
+    unsigned char *out;
+    size_t capacity;
+};
+
+struct huffman_decoder_ctx
+{
+    huffman_decoder dec;
+    unsigned char *out;
+    size_t capacity;
+};
+
+/*
+ * reserve_output makes *pbuf hold at least need bytes, growing it
+ * geometrically.
+ */
+static int
+reserve_output(unsigned char **pbuf, size_t *pcap, size_t need)
+{
+    size_t newcap = *pcap;
+    unsigned char *tmp;
+
+    if(need <= newcap)
+        return 0;
+
+    if(newcap < CACHE_SIZE)
+        newcap = CACHE_SIZE;
+    while(newcap < need)
+        newcap = newcap > SIZE_MAX / 2 ? need : newcap * 2;
+
+    tmp = (unsigned char*)counted_realloc(*pbuf, newcap);
+    if(!tmp)
+        return 1;
+
+    *pbuf = tmp;
+    *pcap = newcap;
+    return 0;
+}
+
+huffman_encoder_ctx*
+huffman_encoder_create(const huffman_options *opts)
+{
+    huffman_encoder_ctx *ctx;
+    huffman_options o;
+
+    if(check_options(opts, &o))
+        return NULL;
+
+    ctx = (huffman_encoder_ctx*)counted_calloc(1, sizeof(*ctx));
+    if(ctx)
+        ctx->opts = o;
+    return ctx;
+}
+
+int
+huffman_encoder_encode(huffman_encoder_ctx *ctx,
+                       const unsigned char *bufin,
+                       size_t bufinlen,
+                       const unsigned char **pbufout,
+                       size_t *pbufoutlen)
+{
+    size_t bound = huffman_encode_bound(bufinlen);
+    double start = 0;
+    int started, rc;
+
+    if(!ctx || (!bufin && bufinlen > 0) || !pbufout || !pbufoutlen
+       || bound == 0)
+        return 1;
+
+    started = start_stats(ctx->opts.stats, &start);
+    rc = reserve_output(&ctx->out, &ctx->capacity, bound)
+         || encode_into(bufin, bufinlen, ctx->out, ctx->capacity, pbufoutlen,
+                        &ctx->opts);
+    finish_stats(started, start);
+    if(rc)
+        return 1;
+
+    *pbufout = ctx->out;
+    return 0;
+}
+
+void
+huffman_encoder_free(huffman_encoder_ctx *ctx)
+{
+    if(!ctx)
+        return;
+
+    free(ctx->out);
+    free(ctx);
+}
+
+huffman_decoder_ctx*
+huffman_decoder_create(void)
+{
+    huffman_decoder_ctx *ctx;
+
+    ctx = (huffman_decoder_ctx*)counted_calloc(1, sizeof(*ctx));
+    if(ctx)
+        init_decoder(&ctx->dec);
+    return ctx;
+}
+
+int
+huffman_decoder_decode(huffman_decoder_ctx *ctx,
+                       const unsigned char *bufin,
+                       size_t bufinlen,
+                       const unsigned char **pbufout,
+                       size_t *pbufoutlen)
+{
+    uint64_t size;
+
+    if(!ctx || !pbufout || !pbufoutlen
+       || huffman_decoded_size(bufin, bufinlen, &size) || size > SIZE_MAX
+       || reserve_output(&ctx->out, &ctx->capacity, size ? (size_t)size : 1)
+       || decode_into(&ctx->dec, bufin, bufinlen, ctx->out, (size_t)size,
+                      pbufoutlen))
+        return 1;
+
+    *pbufout = ctx->out;
+    return 0;
+}
+
+int
+huffman_decoder_decode_into(huffman_decoder_ctx *ctx,
+                            const unsigned char *bufin,
+                            size_t bufinlen,
+                            unsigned char *out,
+                            size_t outcap,
+                            size_t *poutlen)
+{
+    if(!ctx)
+        return 1;
+
+    return decode_into(&ctx->dec, bufin, bufinlen, out, outcap, poutlen);
+}
+
+void
+huffman_decoder_free(huffman_decoder_ctx *ctx)
+{
+    if(!ctx)
+        return;
+
+    free_decoder(&ctx->dec);
+    free(ctx->out);
+    free(ctx);
+}
+
+/*
+ * Shared code tables.
+ *
+ * A table is trained once on sample data and then used for many short
+ * messages, which carry no code lengths of their own: a message is the
+ * table's ID and the message length as varints, then the code bits.
+ * Every byte value gets a code, so a table can encode any message, and
+ * its decoder is built when the table is, so nothing is built per
+ * message. A table is read-only once made and may be shared between
+ * threads.
+ */
+struct huffman_table
+{
+    uint32_t id;
+    unsigned int maxlen;
+    unsigned char lens[MAX_SYMBOLS];
+    huffman_codeword codes[MAX_SYMBOLS];
+    huffman_decoder dec;
+};
+
+static const unsigned char huffman_table_magic[HUFFMAN_MAGIC_LEN] =
+{
+    'H', 'U', 'F', 'T'
+};
+
+/*
+ * make_table builds a table from the code lengths in lens, all of which
+ * must be set.
+ */
+static huffman_table*
+make_table(uint32_t id, const unsigned char *lens)
+{
+    uint64_t codes[MAX_SYMBOLS];
+    huffman_table *t;
+    unsigned int i;
+
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+        if(lens[i] == 0 || lens[i] > HUFFMAN_MAX_CODE_BITS)
+            return NULL;
+
+    if(assign_canonical_codes(lens, codes))
+        return NULL;
+
+    t = (huffman_table*)counted_calloc(1, sizeof(*t));
+    if(!t)
+        return NULL;
+
+    init_decoder(&t->dec);
+    if(build_decoder(&t->dec, codes, lens))
+    {
+        free(t);
+        return NULL;
+    }
+
+    t->id = id;
+    memcpy(t->lens, lens, MAX_SYMBOLS);
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+    {
+        t->codes[i].code = codes[i];
+        t->codes[i].len = lens[i];
+        if(lens[i] > t->maxlen)
+            t->maxlen = lens[i];
+    }
+
+    return t;
+}
+
+/*
+ * table_from_counts builds a table for the symbol counts of a sample.
+ */
+static huffman_table*
+table_from_counts(uint64_t *counts, uint32_t id, unsigned int maxbits)
+{
+    unsigned char lens[MAX_SYMBOLS];
+    unsigned int i;
+
+    /* Bytes the sample lacks still need a code, so every count starts
+       at one. */
+    for(i = 0; i < MAX_SYMBOLS; ++i)
+        ++counts[i];
+
+    calculate_code_lengths(counts, maxbits, lens);
+    return make_table(id, lens);
+}
+
+int
+huffman_table_train(const unsigned char *sample,
+                    size_t samplelen,
+                    uint32_t id,
+                    const huffman_options *opts,
+                    huffman_table **ptable)
+{
+    uint64_t counts[MAX_SYMBOLS];
+    huffman_options o;
+
+    if((!sample && samplelen > 0) || !ptable || check_options(opts, &o))
+        return 1;
+
+    count_symbols(sample, samplelen, counts);
+    *ptable = table_from_counts(counts, id, o.max_code_length);
+    return *ptable == NULL;
+}
+
+int
+huffman_table_save(const huffman_table *t,
+                   unsigned char **pbufout,
+                   size_t *pbufoutlen)
+{
+    unsigned char *buf;
+    size_t n = HUFFMAN_MAGIC_LEN;
+
+    if(!t || !pbufout || !pbufoutlen)
+        return 1;
+
+    buf = (unsigned char*)counted_malloc(HUFFMAN_MAGIC_LEN + MAX_VARINT_LEN
+                                 + MAX_SYMBOLS);
+    if(!buf)
+        return 1;
+
+    memcpy(buf, huffman_table_magic, HUFFMAN_MAGIC_LEN);
+    n += put_varint(buf + n, t->id);
+    n += pack_code_lengths(t->lens, buf + n);
+
+    *pbufout = buf;
+    *pbufoutlen = n;
+    return 0;
+}
+
+int
+huffman_table_load(const unsigned char *bufin,
+                   size_t bufinlen,
+                   huffman_table **ptable)
+{
+    unsigned char lens[MAX_SYMBOLS];
+    unsigned int nsyms;
+    size_t pos = HUFFMAN_MAGIC_LEN;
+    uint64_t id;
+
+    if(!bufin || !ptable || bufinlen < HUFFMAN_MAGIC_LEN
+       || memcmp(bufin, huffman_table_magic, HUFFMAN_MAGIC_LEN) != 0
+       || get_varint(bufin, bufinlen, &pos, &id) || id > UINT32_MAX
+       || unpack_code_lengths(bufin, bufinlen, &pos, lens, &nsyms)
+       || pos != bufinlen)
+        return 1;
+
+    *ptable = make_table((uint32_t)id, lens);
+    return *ptable == NULL;
+}
+
+uint32_t
+huffman_table_id(const huffman_table *t)
+{
+    return t->id;
+}
+
+void
+huffman_table_free(huffman_table *t)
+{
+    if(!t)
+        return;
 
-                *rootOut = new_leaf_node(symbol);
-                *dataBytesOut = dataBytes;
-                return true;
-            }
+    free_decoder(&t->dec);
+    free(t);
+}
 
-            root = new_nonleaf_node(0, NULL, NULL);
-        }
+size_t
+huffman_table_encode_bound(const huffman_table *t, size_t len)
+{
+    size_t overhead = 2 * MAX_VARINT_LEN;
 
-        if (numbits == 0) {
-            // Valid code tables only have 0 bit length codes if they encode only 1 symbol.
-            free_huffman_tree(root);
-            return false;
+    if(len > (SIZE_MAX - overhead) / t->maxlen)
+        return 0;
 
-        }
+    return overhead + numbytes_from_numbits(len * t->maxlen);
+}
 
-        assert(root != NULL);
-        huffman_node *p = root;
-        unsigned char numbytes = (unsigned char)numbytes_from_numbits(numbits);
-        unsigned char *bytes = (unsigned char*)malloc(numbytes);
-        if(fread(bytes, 1, numbytes, in) != numbytes)
-        {
-            free(bytes);
-            free_huffman_tree(root);
-            return false;
-        }
+int
+huffman_encode_with_table(const huffman_table *t,
+                          const unsigned char *bufin,
+                          size_t bufinlen,
+                          unsigned char *out,
+                          size_t outcap,
+                          size_t *poutlen)
+{
+    unsigned char header[2 * MAX_VARINT_LEN];
+    size_t headerlen, bound;
+    bit_writer bw;
 
-        for(unsigned int curbit = 0; curbit < numbits; ++curbit)
-        {
-            if (p->isLeaf)
-            {
-                // Invalid input.
-                free(bytes);
-                free_huffman_tree(root);
-                return false;
-            }
+    if(!t || (!bufin && bufinlen > 0) || !out || !poutlen)
+        return 1;
 
-            if(get_bit(bytes, curbit))
-            {
-                assert(p != NULL);
-                if(p->one == NULL)
-                {
-                    p->one = curbit == (unsigned char)(numbits - 1)
-                             ? new_leaf_node(symbol)
-                             : new_nonleaf_node(0, NULL, NULL);
-                    assert(p->one != NULL);
-                    p->one->parent = p;
-                }
-                assert(p->one != NULL);
-                p = p->one;
-            }
-            else
-            {
-                assert(p != NULL);
-                if(p->zero == NULL)
-                {
-                    p->zero = curbit == (unsigned char)(numbits - 1)
-                              ? new_leaf_node(symbol)
-                              : new_nonleaf_node(0, NULL, NULL);
-                    assert(p->zero != NULL);
-                    p->zero->parent = p;
-                }
-                assert(p->zero != NULL);
-                p = p->zero;
-            }
-        }
+    headerlen = put_varint(header, t->id);
+    headerlen += put_varint(header + headerlen, bufinlen);
 
-        free(bytes);
+    /* Only a buffer that could be too small is worth a counting pass
+       to find the exact size. */
+    bound = huffman_table_encode_bound(t, bufinlen);
+    if(bound == 0 || outcap < bound)
+    {
+        uint64_t counts[MAX_SYMBOLS], numbits = 0;
+        unsigned int i;
+
+        count_symbols(bufin, bufinlen, counts);
+        for(i = 0; i < MAX_SYMBOLS; ++i)
+            numbits += counts[i] * t->lens[i];
+        if(outcap < headerlen
+           || numbytes_from_numbits(numbits) > outcap - headerlen)
+            return 1;
     }
 
-    *rootOut = root;
-    *dataBytesOut = dataBytes;
-    return true;
+    memcpy(out, header, headerlen);
+    bw.out = out + headerlen;
+    bw.bitbuf = 0;
+    bw.bitcount = 0;
+    encode_symbols(t->codes, bufin, bufinlen, &bw);
+    flush_bits(&bw);
+
+    *poutlen = bw.out - out;
+    return 0;
 }
 
+/*
+ * read_message_header reads the table ID and length at the start of a
+ * message encoded with a table and stores the offset of its code bits
+ * in *ppos.
+ */
 static int
-memread(const unsigned char* buf,
-        unsigned int buflen,
-        unsigned int *pindex,
-        void* bufout,
-        unsigned int readlen)
+read_message_header(const unsigned char *bufin,
+                    size_t bufinlen,
+                    uint32_t *pid,
+                    uint64_t *psize,
+                    size_t *ppos)
 {
-    assert(buf && pindex && bufout);
-    assert(buflen >= *pindex);
-    if(buflen < *pindex)
+    uint64_t id;
+
+    *ppos = 0;
+    if(!bufin || get_varint(bufin, bufinlen, ppos, &id) || id > UINT32_MAX
+       || get_varint(bufin, bufinlen, ppos, psize))
+        return 1;
+
+    *pid = (uint32_t)id;
+    return 0;
+}
+
+int
+huffman_message_info(const unsigned char *bufin,
+                     size_t bufinlen,
+                     uint32_t *pid,
+                     uint64_t *psize)
+{
+    size_t pos;
+
+    if(!pid || !psize)
+        return 1;
+
+    return read_message_header(bufin, bufinlen, pid, psize, &pos);
+}
+
+int
+huffman_decode_with_table(const huffman_table *t,
+                          const unsigned char *bufin,
+                          size_t bufinlen,
+                          unsigned char *out,
+                          size_t outcap,
+                          size_t *poutlen)
+{
+    bit_reader br;
+    uint64_t size;
+    uint32_t id;
+    size_t pos, done;
+
+    if(!t || !poutlen || (!out && outcap > 0)
+       || read_message_header(bufin, bufinlen, &id, &size, &pos)
+       || id != t->id || size > outcap)
         return 1;
-    if(readlen + *pindex >= buflen)
+
+    init_bit_reader(&br, bufin + pos, bufinlen - pos, 1);
+    if(decode_symbols(&t->dec, &br, out, (size_t)size, &done)
+       || done != size)
         return 1;
-    memcpy(bufout, buf + *pindex, readlen);
-    *pindex += readlen;
+
+    *poutlen = (size_t)size;
     return 0;
 }
 
-static huffman_node*
-read_code_table_from_memory(const unsigned char* bufin,
-                            unsigned int bufinlen,
-                            unsigned int *pindex,
-                            uint32_t *pDataBytes)
+/*
+ * Batches.
+ *
+ * A batch is cut into runs of whole messages of about BATCH_RUN bytes
+ * each, which are the jobs handed to the threads. When encoding, each
+ * run writes its messages back to back into its own part of the
+ * arena, sized by their bounds, and the parts are moved together
+ * afterwards. Decoded sizes are known from the message headers, so
+ * decoding goes straight to the final place.
+ */
+#define BATCH_RUN (64 * 1024)
+
+typedef struct batch_job_tag
 {
-    huffman_node *root = new_nonleaf_node(0, NULL, NULL);
-    uint32_t count;
+    /* The messages of the run: buffers when encoding, the input arena
+       and its offsets when decoding. */
+    const huffman_buffer *in;
+    const unsigned char *arena;
+    const size_t *inoffsets;
+    size_t first;
+    size_t count;
+    const huffman_table *table;
+    const huffman_options *opts;
+    /* Output offsets of the messages, taken from out when encoding. */
+    unsigned char *out;
+    size_t *offsets;
+    size_t outlen;
+    uint64_t counts[MAX_SYMBOLS];
+    int rc;
+} batch_job;
 
-    /* Read the number of entries.
-       (it is stored in network byte order). */
-    if(memread(bufin, bufinlen, pindex, &count, sizeof(count)))
+/*
+ * cut_batch cuts the n messages whose sizes size_of gives into runs,
+ * storing them in a malloc'd array of jobs. Returns the number of jobs,
+ * or 0 if there are no messages or it fails.
+ */
+static size_t
+cut_batch(size_t n,
+          size_t (*size_of)(const void*, size_t),
+          const void *arg,
+          batch_job **pjobs)
+{
+    batch_job *jobs;
+    size_t i, njobs = 0, run = 0;
+
+    for(i = 0; i < n; ++i)
     {
-        free_huffman_tree(root);
-        return NULL;
+        run += size_of(arg, i);
+        if(run >= BATCH_RUN || i == n - 1)
+        {
+            ++njobs;
+            run = 0;
+        }
     }
 
-    count = ntohl(count);
+    if(njobs == 0)
+        return 0;
+    jobs = (batch_job*)counted_calloc(njobs, sizeof(*jobs));
+    if(!jobs)
+        return 0;
 
-    /* Read the number of data bytes this encoding represents. */
-    if(memread(bufin, bufinlen, pindex, pDataBytes, sizeof(*pDataBytes)))
+    njobs = 0;
+    for(i = 0; i < n; ++i)
     {
-        free_huffman_tree(root);
-        return NULL;
+        if(jobs[njobs].count++ == 0)
+            jobs[njobs].first = i;
+        run += size_of(arg, i);
+        if(run >= BATCH_RUN || i == n - 1)
+        {
+            ++njobs;
+            run = 0;
+        }
     }
 
-    *pDataBytes = ntohl(*pDataBytes);
+    *pjobs = jobs;
+    return njobs;
+}
 
-    /* Read the entries. */
-    while(count-- > 0)
+static size_t
+buffer_size(const void *arg, size_t i)
+{
+    return ((const huffman_buffer*)arg)[i].len;
+}
+
+static size_t
+message_size(const void *arg, size_t i)
+{
+    const size_t *offsets = (const size_t*)arg;
+
+    return offsets[i + 1] - offsets[i];
+}
+
+static void
+count_batch_job(void *arg)
+{
+    batch_job *job = (batch_job*)arg;
+    uint64_t counts[MAX_SYMBOLS];
+    size_t i;
+    unsigned int k;
+
+    for(i = job->first; i < job->first + job->count; ++i)
     {
-        unsigned int curbit;
-        unsigned char symbol;
-        unsigned char numbits;
-        unsigned char numbytes;
-        unsigned char *bytes;
-        huffman_node *p = root;
+        const unsigned char *data = job->in[i].data;
+        size_t j, len = job->in[i].len;
 
-        if(memread(bufin, bufinlen, pindex, &symbol, sizeof(symbol)))
+        /* As in count_symbols, short records are counted directly
+           rather than through a histogram cleared and folded for each
+           one. */
+        if(len < HIST_DIRECT)
         {
-            free_huffman_tree(root);
-            return NULL;
+            for(j = 0; j < len; ++j)
+                ++job->counts[data[j]];
+            continue;
         }
 
-        if(memread(bufin, bufinlen, pindex, &numbits, sizeof(numbits)))
-        {
-            free_huffman_tree(root);
-            return NULL;
-        }
+        count_symbols(data, len, counts);
+        for(k = 0; k < MAX_SYMBOLS; ++k)
+            job->counts[k] += counts[k];
+    }
+}
 
-        numbytes = (unsigned char)numbytes_from_numbits(numbits);
-        bytes = (unsigned char*)malloc(numbytes);
-        if(memread(bufin, bufinlen, pindex, bytes, numbytes))
-        {
-            free(bytes);
-            free_huffman_tree(root);
-            return NULL;
-        }
+static void
+encode_batch_job(void *arg)
+{
+    batch_job *job = (batch_job*)arg;
+    size_t i, pos = 0, len;
 
-        for(curbit = 0; curbit < numbits; ++curbit)
+    for(i = job->first; i < job->first + job->count; ++i)
+    {
+        const huffman_buffer *b = &job->in[i];
+        size_t bound = job->table
+                       ? huffman_table_encode_bound(job->table, b->len)
+                       : huffman_encode_bound(b->len);
+
+        job->offsets[i] = pos;
+        if(job->table
+           ? huffman_encode_with_table(job->table, b->data, b->len,
+                                       job->out + pos, bound, &len)
+           : encode_into(b->data, b->len, job->out + pos, bound, &len,
+                         job->opts))
         {
-            if(get_bit(bytes, curbit))
-            {
-                if(p->one == NULL)
-                {
-                    p->one = curbit == (unsigned char)(numbits - 1)
-                             ? new_leaf_node(symbol)
-                             : new_nonleaf_node(0, NULL, NULL);
-                    p->one->parent = p;
-                }
-                p = p->one;
-            }
-            else
-            {
-                if(p->zero == NULL)
-                {
-                    p->zero = curbit == (unsigned char)(numbits - 1)
-                              ? new_leaf_node(symbol)
-                              : new_nonleaf_node(0, NULL, NULL);
-                    p->zero->parent = p;
-                }
-                p = p->zero;
-            }
+            job->rc = 1;
+            return;
         }
-
-        free(bytes);
+        pos += len;
     }
 
-    return root;
+    job->outlen = pos;
 }
 
+/*
+ * failed_job returns non-zero if any of the jobs failed.
+ */
 static int
-do_file_encode(FILE* in, FILE* out, SymbolEncoder *se)
+failed_job(const batch_job *jobs, size_t njobs)
 {
-    unsigned char curbyte = 0;
-    unsigned char curbit = 0;
-    int c;
+    size_t j;
 
-    while((c = fgetc(in)) != EOF)
-    {
-        unsigned char uc = (unsigned char)c;
-        huffman_code *code = (*se)[uc];
-        unsigned long i;
+    for(j = 0; j < njobs; ++j)
+        if(jobs[j].rc)
+            return 1;
 
-        for(i = 0; i < code->numbits; ++i)
-        {
-            /* Add the current bit to curbyte. */
-            curbyte |= get_bit(code->bits, i) << curbit;
+    return 0;
+}
 
-            /* If this byte is filled up then write it
-             * out and reset the curbit and curbyte. */
-            if(++curbit == 8)
-            {
-                fputc(curbyte, out);
-                curbyte = 0;
-                curbit = 0;
-            }
-        }
-    }
+/*
+ * batch_table builds a table, with ID 0, from the combined counts of
+ * the messages of jobs.
+ */
+static huffman_table*
+batch_table(batch_job *jobs,
+            size_t njobs,
+            unsigned int nthreads,
+            unsigned int maxbits)
+{
+    uint64_t counts[MAX_SYMBOLS] = { 0 };
+    size_t j;
+    unsigned int k;
+
+    if(run_parallel(jobs, njobs, sizeof(*jobs), nthreads, count_batch_job))
+        return NULL;
 
-    if(curbit > 0)
-        fputc(curbyte, out);
+    for(j = 0; j < njobs; ++j)
+        for(k = 0; k < MAX_SYMBOLS; ++k)
+            counts[k] += jobs[j].counts[k];
 
-    return 0;
+    return table_from_counts(counts, 0, maxbits);
 }
 
+/*
+ * encode_runs encodes the n messages of jobs with table, or each as a
+ * stream of its own if it is NULL, into a malloc'd arena it stores in
+ * *parena, and stores their offsets in offsets.
+ */
 static int
-do_memory_encode(buf_cache *pc,
-                 const unsigned char* bufin,
-                 unsigned int bufinlen,
-                 SymbolEncoder *se)
+encode_runs(batch_job *jobs,
+            size_t njobs,
+            size_t n,
+            const huffman_table *table,
+            unsigned int nthreads,
+            size_t *offsets,
+            unsigned char **parena)
 {
-    unsigned char curbyte = 0;
-    unsigned char curbit = 0;
-    unsigned int i;
+    unsigned char *arena, *tmp;
+    size_t i, j, total = 0, pos = 0;
 
-    for(i = 0; i < bufinlen; ++i)
+    /* Give each run room for the bounds of its messages. */
+    for(j = 0; j < njobs; ++j)
     {
-        unsigned char uc = bufin[i];
-        huffman_code *code = (*se)[uc];
-        unsigned long i;
-
-        for(i = 0; i < code->numbits; ++i)
+        jobs[j].table = table;
+        jobs[j].outlen = total;
+        for(i = jobs[j].first; i < jobs[j].first + jobs[j].count; ++i)
         {
-            /* Add the current bit to curbyte. */
-            curbyte |= get_bit(code->bits, i) << curbit;
+            size_t len = jobs[j].in[i].len;
+            size_t bound = table ? huffman_table_encode_bound(table, len)
+                           : huffman_encode_bound(len);
 
-            /* If this byte is filled up then write it
-             * out and reset the curbit and curbyte. */
-            if(++curbit == 8)
-            {
-                if(write_cache(pc, &curbyte, sizeof(curbyte)))
-                    return 1;
-                curbyte = 0;
-                curbit = 0;
-            }
+            if(bound == 0 || bound > SIZE_MAX - total)
+                return 1;
+            total += bound;
         }
     }
 
-    /*
-     * If there is data in curbyte that has not been
-     * output yet, which means that the last encoded
-     * character did not fall on a byte boundary,
-     * then output it.
-     */
-    return curbit > 0 ? write_cache(pc, &curbyte, sizeof(curbyte)) : 0;
+    arena = (unsigned char*)counted_malloc(total ? total : 1);
+    if(!arena)
+        return 1;
+    for(j = 0; j < njobs; ++j)
+        jobs[j].out = arena + jobs[j].outlen;
+
+    if(run_parallel(jobs, njobs, sizeof(*jobs), nthreads, encode_batch_job)
+       || failed_job(jobs, njobs))
+    {
+        free(arena);
+        return 1;
+    }
+
+    /* Move the runs together; the first never moves. */
+    for(j = 0; j < njobs; ++j)
+    {
+        memmove(arena + pos, jobs[j].out, jobs[j].outlen);
+        for(i = jobs[j].first; i < jobs[j].first + jobs[j].count; ++i)
+            offsets[i] += pos;
+        pos += jobs[j].outlen;
+    }
+    offsets[n] = pos;
+
+    tmp = (unsigned char*)counted_realloc(arena, pos ? pos : 1);
+    *parena = tmp ? tmp : arena;
+    return 0;
 }
 
-/*
- * huffman_encode_file huffman encodes in to out.
- */
 int
-huffman_encode_file(FILE *in, FILE *out)
+huffman_encode_batch(const huffman_buffer *in,
+                     size_t n,
+                     const huffman_options *opts,
+                     huffman_table **ptable,
+                     unsigned char **pout,
+                     size_t **poffsets)
 {
-    SymbolFrequencies sf;
-    SymbolEncoder *se;
-    huffman_node *root = NULL;
-    int rc;
-    unsigned int symbol_count;
+    huffman_table *table = NULL;
+    batch_job *jobs = NULL;
+    unsigned char *arena = NULL;
+    size_t *offsets;
+    size_t i, j, njobs;
+    unsigned int nthreads;
+    huffman_options o;
+    double start = 0;
+    int started, rc;
+
+    if((!in && n > 0) || !pout || !poffsets || check_options(opts, &o)
+       || n > SIZE_MAX / sizeof(*offsets) - 1)
+        return 1;
+    for(i = 0; i < n; ++i)
+        if(!in[i].data && in[i].len > 0)
+            return 1;
+
+    started = start_stats(o.stats, &start);
+    nthreads = clamp_threads(o.threads);
+    njobs = cut_batch(n, buffer_size, in, &jobs);
+    offsets = (size_t*)counted_malloc((n + 1) * sizeof(*offsets));
+    rc = !offsets || (n > 0 && njobs == 0);
+
+    for(j = 0; rc == 0 && j < njobs; ++j)
+    {
+        jobs[j].in = in;
+        jobs[j].opts = &o;
+        jobs[j].offsets = offsets;
+    }
 
-    /* Get the frequency of each symbol in the input file. */
-    symbol_count = get_symbol_frequencies(sf, in);
+    if(rc == 0 && ptable)
+    {
+        table = *ptable ? *ptable
+                : batch_table(jobs, njobs, nthreads, o.max_code_length);
+        rc = table == NULL;
+    }
 
-    /* Build an optimal table from the symbolCount. */
-    se = calculate_huffman_codes(sf);
-    root = sf[0];
+    if(rc == 0)
+        rc = encode_runs(jobs, njobs, n, table, nthreads, offsets, &arena);
 
-    rewind(in);
-    rc = write_code_table(out, se, symbol_count);
     if(rc == 0)
-        rc = do_file_encode(in, out, se);
+    {
+        if(ptable)
+            *ptable = table;
+        *pout = arena;
+        *poffsets = offsets;
+    }
+    else
+    {
+        if(ptable && table != *ptable)
+            huffman_table_free(table);
+        free(offsets);
+    }
 
-    /* Free the Huffman tree. */
-    free_huffman_tree(root);
-    free_encoder(se);
+    free(jobs);
+    finish_stats(started, start);
     return rc;
 }
 
-int
-huffman_decode_file(FILE *in, FILE *out)
+static void
+size_batch_job(void *arg)
 {
-    huffman_node *root = NULL, *p = NULL;
-    int c = 0;
-    unsigned int data_count = 0;
+    batch_job *job = (batch_job*)arg;
+    size_t i;
 
-    /* Read the Huffman code table. */
-    if (!read_code_table(in, &root, &data_count))
+    for(i = job->first; i < job->first + job->count; ++i)
     {
-        return 1;
+        const unsigned char *msg = job->arena + job->inoffsets[i];
+        size_t len = job->inoffsets[i + 1] - job->inoffsets[i];
+        uint64_t size;
+        uint32_t id;
+
+        if((job->table
+            ? huffman_message_info(msg, len, &id, &size)
+              || id != huffman_table_id(job->table)
+            : huffman_decoded_size(msg, len, &size))
+           || size > SIZE_MAX)
+        {
+            job->rc = 1;
+            return;
+        }
+        job->offsets[i + 1] = (size_t)size;
     }
+}
 
-    if (root == NULL && data_count == 0) {
-        return 0;
-    }
+static void
+decode_batch_job(void *arg)
+{
+    batch_job *job = (batch_job*)arg;
+    huffman_decoder dec;
+    size_t i, len;
 
-    if (root->isLeaf) {
-        while(data_count-- > 0) {
-            fputc(root->symbol, out);
+    /* Messages of their own share a decoder's table storage. */
+    init_decoder(&dec);
+    for(i = job->first; i < job->first + job->count; ++i)
+    {
+        const unsigned char *msg = job->arena + job->inoffsets[i];
+        size_t msglen = job->inoffsets[i + 1] - job->inoffsets[i];
+        size_t size = job->offsets[i + 1] - job->offsets[i];
+
+        if((job->table
+            ? huffman_decode_with_table(job->table, msg, msglen,
+                                        job->out + job->offsets[i], size,
+                                        &len)
+            : decode_into(&dec, msg, msglen, job->out + job->offsets[i],
+                          size, &len))
+           || len != size)
+        {
+            job->rc = 1;
+            break;
         }
-        free_huffman_tree(root);
-        return 0;
     }
+    free_decoder(&dec);
+}
 
-    // This is a multi-symbol, non-empty file.
-    p = root;
-    while(data_count > 0 && (c = fgetc(in)) != EOF)
-    {
-        unsigned char byte = (unsigned char)c;
-        unsigned char mask = 1;
-        while(data_count > 0 && mask)
-        {
-            p = byte & mask ? p->one : p->zero;
-            if (p == NULL)
-            {
-                // Invalid file.
-                free_huffman_tree(root);
-                return 1;
-            }
+/*
+ * decode_sizes stores in offsets where the decoded messages of jobs go
+ * in the output arena, after reading their sizes.
+ */
+static int
+decode_sizes(batch_job *jobs,
+             size_t njobs,
+             size_t n,
+             unsigned int nthreads,
+             size_t *offsets)
+{
+    size_t i;
 
-            mask <<= 1;
+    if(run_parallel(jobs, njobs, sizeof(*jobs), nthreads, size_batch_job)
+       || failed_job(jobs, njobs))
+        return 1;
 
-            if(p->isLeaf)
-            {
-                fputc(p->symbol, out);
-                p = root;
-                --data_count;
-            }
-        }
+    offsets[0] = 0;
+    for(i = 0; i < n; ++i)
+    {
+        if(offsets[i + 1] > SIZE_MAX - offsets[i])
+            return 1;
+        offsets[i + 1] += offsets[i];
     }
 
-    free_huffman_tree(root);
     return 0;
 }
 
-#define CACHE_SIZE 1024
-
-int huffman_encode_memory(const unsigned char *bufin,
-                          unsigned int bufinlen,
-                          unsigned char **pbufout,
-                          unsigned int *pbufoutlen)
+int
+huffman_decode_batch(const unsigned char *in,
+                     const size_t *offsets,
+                     size_t n,
+                     const huffman_table *table,
+                     const huffman_options *opts,
+                     unsigned char **pout,
+                     size_t **poffsets)
 {
-    SymbolFrequencies sf;
-    SymbolEncoder *se;
-    huffman_node *root = NULL;
-    int rc;
-    unsigned int symbol_count;
-    buf_cache cache;
-
-    /* Ensure the arguments are valid. */
-    if(!pbufout || !pbufoutlen)
-        return 1;
-
-    if(init_cache(&cache, CACHE_SIZE, pbufout, pbufoutlen))
+    batch_job *jobs = NULL;
+    unsigned char *arena = NULL;
+    size_t *outoffsets;
+    size_t i, j, njobs;
+    unsigned int nthreads;
+    huffman_options o;
+    double start = 0;
+    int started, rc;
+
+    if(!offsets || (!in && offsets[n] > 0) || !pout || !poffsets
+       || check_options(opts, &o)
+       || n > SIZE_MAX / sizeof(*outoffsets) - 1)
         return 1;
+    for(i = 0; i < n; ++i)
+        if(offsets[i] > offsets[i + 1])
+            return 1;
 
-    symbol_count = get_symbol_frequencies_from_memory(sf, bufin, bufinlen);
+    started = start_stats(o.stats, &start);
+    nthreads = clamp_threads(o.threads);
+    njobs = cut_batch(n, message_size, offsets, &jobs);
+    outoffsets = (size_t*)counted_malloc((n + 1) * sizeof(*outoffsets));
+    rc = !outoffsets || (n > 0 && njobs == 0);
 
-    se = calculate_huffman_codes(sf);
-    root = sf[0];
+    for(j = 0; rc == 0 && j < njobs; ++j)
+    {
+        jobs[j].arena = in;
+        jobs[j].inoffsets = offsets;
+        jobs[j].table = table;
+        jobs[j].offsets = outoffsets;
+    }
 
-    rc = write_code_table_to_memory(&cache, se, symbol_count);
     if(rc == 0)
-        rc = do_memory_encode(&cache, bufin, bufinlen, se);
-
-    /* Flush the cache. */
-    flush_cache(&cache);
-
-    /* Free the Huffman tree. */
-    free_huffman_tree(root);
-    free_encoder(se);
-    free_cache(&cache);
-    return rc;
-}
-
-int huffman_decode_memory(const unsigned char *bufin,
-                          unsigned int bufinlen,
-                          unsigned char **pbufout,
-                          unsigned int *pbufoutlen)
-{
-    huffman_node *root, *p;
-    unsigned int data_count;
-    unsigned int i = 0;
-    unsigned char *buf;
-    unsigned int bufcur = 0;
+        rc = decode_sizes(jobs, njobs, n, nthreads, outoffsets);
 
-    /* Ensure the arguments are valid. */
-    if(!pbufout || !pbufoutlen)
-        return 1;
+    if(rc == 0)
+    {
+        arena = (unsigned char*)counted_malloc(outoffsets[n] ? outoffsets[n]
+                                                             : 1);
+        rc = arena == NULL;
+    }
 
-    /* Read the Huffman code table. */
-    root = read_code_table_from_memory(bufin, bufinlen, &i, &data_count);
-    if(!root)
-        return 1;
+    for(j = 0; rc == 0 && j < njobs; ++j)
+        jobs[j].out = arena;
 
-    buf = (unsigned char*)malloc(data_count);
+    if(rc == 0)
+        rc = run_parallel(jobs, njobs, sizeof(*jobs), nthreads,
+                          decode_batch_job)
+             || failed_job(jobs, njobs);
 
-    /* Decode the memory. */
-    p = root;
-    for(; i < bufinlen && data_count > 0; ++i)
+    if(rc == 0)
     {
-        unsigned char byte = bufin[i];
-        unsigned char mask = 1;
-        while(data_count > 0 && mask)
-        {
-            p = byte & mask ? p->one : p->zero;
-            mask <<= 1;
-
-            if(p->isLeaf)
-            {
-                buf[bufcur++] = p->symbol;
-                p = root;
-                --data_count;
-            }
-        }
+        *pout = arena;
+        *poffsets = outoffsets;
+    }
+    else
+    {
+        free(arena);
+        free(outoffsets);
     }
 
-    free_huffman_tree(root);
-    *pbufout = buf;
-    *pbufoutlen = bufcur;
-    return 0;
+    free(jobs);
+    finish_stats(started, start);
+    return rc;
 }
@@ -3,6 +3,15 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Code lengths are limited to HUFFMAN_MAX_CODE_LENGTH bits by the
+ * format; a lower limit can be set in huffman_options, down to the 8
+ * bits every byte value needs.
+ */
+#define HUFFMAN_MIN_CODE_LENGTH	8
+#define HUFFMAN_MAX_CODE_LENGTH	56
 
 int huffman_encode_file(FILE *in, FILE *out);
 int huffman_decode_file(FILE *in, FILE *out);
@@ -15,4 +24,322 @@ int huffman_decode_memory(const unsigned char *bufin,
 						  unsigned char **bufout,
 						  uint32_t *pbufoutlen);
 
+/*
+ * The memory interface with size_t lengths, for data that may not
+ * fit in 32 bits. The uint32_t functions above fail on such data.
+ */
+int huffman_encode_memory64(const unsigned char *bufin,
+							size_t bufinlen,
+							unsigned char **pbufout,
+							size_t *pbufoutlen);
+int huffman_decode_memory64(const unsigned char *bufin,
+							size_t bufinlen,
+							unsigned char **pbufout,
+							size_t *pbufoutlen);
+
+/*
+ * Block-parallel encoding on up to nthreads threads. The output is
+ * the same stream the serial encoders produce.
+ */
+int huffman_encode_file_mt(FILE *in, FILE *out, unsigned int nthreads);
+int huffman_encode_memory_mt(const unsigned char *bufin,
+							 size_t bufinlen,
+							 unsigned char **pbufout,
+							 size_t *pbufoutlen,
+							 unsigned int nthreads);
+
+/*
+ * Block-parallel decoding on up to nthreads threads. The file variant
+ * needs a seekable input holding a stream with a block index; other
+ * input is decoded serially. Blocks are written straight to their
+ * place when the output is a regular file.
+ */
+int huffman_decode_file_mt(FILE *in, FILE *out, unsigned int nthreads);
+int huffman_decode_memory_mt(const unsigned char *bufin,
+							 size_t bufinlen,
+							 unsigned char **pbufout,
+							 size_t *pbufoutlen,
+							 unsigned int nthreads);
+
+/*
+ * Decode the len bytes that start at offset in the decoded data into
+ * out, decoding only the blocks that hold them. The file variant reads
+ * a version 2 stream from the current position of a seekable in and
+ * leaves that position unchanged. Fails if the range runs past the end
+ * of the data.
+ */
+int huffman_decode_range(const unsigned char *bufin,
+						 size_t bufinlen,
+						 uint64_t offset,
+						 size_t len,
+						 unsigned char *out);
+int huffman_decode_file_range(FILE *in,
+							  uint64_t offset,
+							  size_t len,
+							  unsigned char *out);
+
+/*
+ * Encoder options. huffman_options_init sets the defaults, which are
+ * what the functions above use.
+ *
+ * max_code_length	longest code to use. Streams whose codes are no
+ * 					longer than 11 bits decode with one table lookup
+ * 					per symbol.
+ * threads			number of threads to encode on
+ * streams			bit streams per block, 1 or 4. Four streams decode
+ * 					faster; blocks under 4 KiB always use one.
+ * fast				non-zero to build the codes of each block from a
+ * 					sample of it rather than counting every byte, so
+ * 					the block is read once. Output is a little larger.
+ * stats			if not NULL, filled in with statistics of each call
+ * 					made with these options, see huffman_stats
+ * pipeline			non-zero for the file functions to read and write
+ * 					on threads of their own, a few MiB at a time, and
+ * 					code while those wait on the files. Input is then
+ * 					read rather than mapped, and ahead of the coder
+ * 					until its end or a few MiB past what is used; a
+ * 					seekable input is left just after what was used.
+ * 					Ignored when threads is above one.
+ */
+typedef struct huffman_stats huffman_stats;
+
+typedef struct huffman_options
+{
+	unsigned int max_code_length;
+	unsigned int threads;
+	unsigned int streams;
+	unsigned int fast;
+	huffman_stats *stats;
+	unsigned int pipeline;
+} huffman_options;
+
+void huffman_options_init(huffman_options *opts);
+
+/*
+ * Encode with the given options; a NULL opts means the defaults.
+ * Decode with the threads, stats and pipeline of the given options,
+ * through the _mt functions when threads is above one.
+ */
+int huffman_encode_file_opts(FILE *in,
+							 FILE *out,
+							 const huffman_options *opts);
+int huffman_encode_memory_opts(const unsigned char *bufin,
+							   size_t bufinlen,
+							   unsigned char **pbufout,
+							   size_t *pbufoutlen,
+							   const huffman_options *opts);
+int huffman_decode_file_opts(FILE *in,
+							 FILE *out,
+							 const huffman_options *opts);
+int huffman_decode_memory_opts(const unsigned char *bufin,
+							   size_t bufinlen,
+							   unsigned char **pbufout,
+							   size_t *pbufoutlen,
+							   const huffman_options *opts);
+
+/*
+ * Statistics of one call, cleared when it starts, for telling whether
+ * a job is bound by I/O or by coding. Each phase has the time spent in
+ * it in seconds and the bytes it handled:
+ *
+ * read				reading input. Mapped input is only counted here;
+ * 					the time to page it in goes to the phases that
+ * 					touch it first.
+ * histogram		counting the symbols of each block
+ * tree				building code lengths and canonical codes
+ * table			packing code lengths into block headers, or
+ * 					unpacking them and building decode tables
+ * encode, decode	coding the symbols of each block
+ * write			writing output to a file
+ *
+ * Phase times add up over threads, so they can exceed seconds, the
+ * wall time of the call. allocations counts the memory blocks the
+ * library allocated or grew, and max_code_length is the longest code
+ * of any block. Only version 2 streams are broken down into phases.
+ */
+enum
+{
+	HUFFMAN_PHASE_READ,
+	HUFFMAN_PHASE_HISTOGRAM,
+	HUFFMAN_PHASE_TREE,
+	HUFFMAN_PHASE_TABLE,
+	HUFFMAN_PHASE_ENCODE,
+	HUFFMAN_PHASE_DECODE,
+	HUFFMAN_PHASE_WRITE,
+	HUFFMAN_PHASES
+};
+
+typedef struct huffman_phase
+{
+	double seconds;
+	uint64_t bytes;
+} huffman_phase;
+
+struct huffman_stats
+{
+	double seconds;
+	huffman_phase phases[HUFFMAN_PHASES];
+	uint64_t allocations;
+	unsigned int max_code_length;
+};
+
+/*
+ * huffman_encode_bound returns the most bytes encoding len bytes can
+ * take, or 0 if that doesn't fit in a size_t.
+ *
+ * huffman_encode_into encodes into the outcap bytes at out, on the
+ * calling thread and without allocating memory, and stores the encoded
+ * length in *poutlen. It fails if outcap is too small, which it can't
+ * be if it is at least huffman_encode_bound(bufinlen). A NULL opts
+ * means the defaults; opts->threads is ignored.
+ */
+size_t huffman_encode_bound(size_t len);
+int huffman_encode_into(const unsigned char *bufin,
+						size_t bufinlen,
+						unsigned char *out,
+						size_t outcap,
+						size_t *poutlen,
+						const huffman_options *opts);
+
+/*
+ * huffman_decoded_size stores in *psize the size the data in bufin
+ * decodes to, reading only the stream's headers.
+ *
+ * huffman_decode_into decodes into the outcap bytes at out and stores
+ * the decoded length in *poutlen, failing if outcap is too small.
+ */
+int huffman_decoded_size(const unsigned char *bufin,
+						 size_t bufinlen,
+						 uint64_t *psize);
+int huffman_decode_into(const unsigned char *bufin,
+						size_t bufinlen,
+						unsigned char *out,
+						size_t outcap,
+						size_t *poutlen);
+
+/*
+ * Reusable contexts for encoding and decoding many short messages.
+ * A context owns its output buffer and table storage, which later
+ * calls reuse instead of allocating again. A context may be used by
+ * one thread at a time; keep one per thread.
+ *
+ * huffman_encoder_create returns NULL on failure, including invalid
+ * opts; a NULL opts means the defaults and opts->threads is ignored.
+ * huffman_encoder_encode and huffman_decoder_decode point *pbufout at
+ * the context's buffer, which stays valid until the next call on the
+ * context or until it is freed.
+ */
+typedef struct huffman_encoder_ctx huffman_encoder_ctx;
+typedef struct huffman_decoder_ctx huffman_decoder_ctx;
+
+huffman_encoder_ctx* huffman_encoder_create(const huffman_options *opts);
+int huffman_encoder_encode(huffman_encoder_ctx *ctx,
+						   const unsigned char *bufin,
+						   size_t bufinlen,
+						   const unsigned char **pbufout,
+						   size_t *pbufoutlen);
+void huffman_encoder_free(huffman_encoder_ctx *ctx);
+
+huffman_decoder_ctx* huffman_decoder_create(void);
+int huffman_decoder_decode(huffman_decoder_ctx *ctx,
+						   const unsigned char *bufin,
+						   size_t bufinlen,
+						   const unsigned char **pbufout,
+						   size_t *pbufoutlen);
+int huffman_decoder_decode_into(huffman_decoder_ctx *ctx,
+								const unsigned char *bufin,
+								size_t bufinlen,
+								unsigned char *out,
+								size_t outcap,
+								size_t *poutlen);
+void huffman_decoder_free(huffman_decoder_ctx *ctx);
+
+/*
+ * Shared code tables for short messages. huffman_table_train builds a
+ * table from sample data, giving every byte value a code, and tags it
+ * with id. Messages encoded with a table carry only the table's ID and
+ * their length, not code lengths of their own. A table is read-only
+ * once made and may be shared between threads.
+ *
+ * huffman_table_save serializes a table into a malloc'd buffer, which
+ * huffman_table_load reads back.
+ *
+ * huffman_encode_with_table encodes into the outcap bytes at out,
+ * which never needs more than huffman_table_encode_bound(t, bufinlen)
+ * bytes. huffman_message_info reads the table ID and decoded size of a
+ * message, so the receiver can pick the table for it.
+ * huffman_decode_with_table fails if the message wasn't encoded with t.
+ */
+typedef struct huffman_table huffman_table;
+
+int huffman_table_train(const unsigned char *sample,
+						size_t samplelen,
+						uint32_t id,
+						const huffman_options *opts,
+						huffman_table **ptable);
+int huffman_table_save(const huffman_table *t,
+					   unsigned char **pbufout,
+					   size_t *pbufoutlen);
+int huffman_table_load(const unsigned char *bufin,
+					   size_t bufinlen,
+					   huffman_table **ptable);
+uint32_t huffman_table_id(const huffman_table *t);
+void huffman_table_free(huffman_table *t);
+
+size_t huffman_table_encode_bound(const huffman_table *t, size_t len);
+int huffman_encode_with_table(const huffman_table *t,
+							  const unsigned char *bufin,
+							  size_t bufinlen,
+							  unsigned char *out,
+							  size_t outcap,
+							  size_t *poutlen);
+int huffman_message_info(const unsigned char *bufin,
+						 size_t bufinlen,
+						 uint32_t *pid,
+						 uint64_t *psize);
+int huffman_decode_with_table(const huffman_table *t,
+							  const unsigned char *bufin,
+							  size_t bufinlen,
+							  unsigned char *out,
+							  size_t outcap,
+							  size_t *poutlen);
+
+/*
+ * Batches of short messages. huffman_encode_batch encodes each of the n
+ * buffers at in as a message of its own, on up to opts->threads
+ * threads, into one malloc'd arena it points *pout at. *poffsets is
+ * pointed at a malloc'd array of n + 1 offsets into the arena; message
+ * i is the bytes from (*poffsets)[i] up to (*poffsets)[i + 1].
+ *
+ * With a NULL ptable each message is a stream of its own, as from
+ * huffman_encode_into. Otherwise all are encoded with the table
+ * *ptable, as from huffman_encode_with_table, and carry no code
+ * lengths. If *ptable is NULL, a table with ID 0 is first built from
+ * the combined counts of the batch and stored there for the caller to
+ * save and free.
+ *
+ * huffman_decode_batch decodes the n messages in in, laid out by the n
+ * + 1 offsets, the same way, into an arena and offsets as above. table
+ * is the one they were encoded with, or NULL for streams of their own.
+ */
+typedef struct huffman_buffer
+{
+	const unsigned char *data;
+	size_t len;
+} huffman_buffer;
+
+int huffman_encode_batch(const huffman_buffer *in,
+						 size_t n,
+						 const huffman_options *opts,
+						 huffman_table **ptable,
+						 unsigned char **pout,
+						 size_t **poffsets);
+int huffman_decode_batch(const unsigned char *in,
+						 const size_t *offsets,
+						 size_t n,
+						 const huffman_table *table,
+						 const huffman_options *opts,
+						 unsigned char **pout,
+						 size_t **poffsets);
+
 #endif
@@ -2,3 +2,23 @@
 #!/bin/bash
 ./tool -i test/input/1.txt -o test/output/1.txt && echo "TEST PASS" || echo "TEST FAILED"
 ./tool -i test/input/2.txt -o test/output/2.txt && echo "TEST PASS" || echo "TEXT FAILED"
+cat test/input/1.txt | ./tool | ./tool -d | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+./tool -d -i test/input/1.v1 | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+cat test/input/1.v1 | ./tool -d | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+./tool -d -m -i test/input/1.v1 | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+./tool -j 2 -i test/input/1.txt | ./tool -d -j 2 | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+./tool -l 11 -i test/input/1.txt | ./tool -d | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+tab=$(mktemp)
+./tool -t -n 7 -i test/input/1.txt -o "$tab" && ./tool -T "$tab" -i test/input/1.txt | ./tool -d -T "$tab" | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+rm -f "$tab"
+./tool -s 1 -i test/input/1.txt | ./tool -d | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+./tool -f -i test/input/1.txt | ./tool -d | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+head -c 100000 /dev/zero | ./tool | ./tool -d | cmp -s - <(head -c 100000 /dev/zero) && echo "TEST PASS" || echo "TEST FAILED"
+./tool -v -m -i test/input/1.txt 2>/dev/null | ./tool -d -v 2>/dev/null | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+HUFFMAN_CPU=portable ./tool -i test/input/1.txt | ./tool -d | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+./tool -p -i test/input/1.txt | ./tool -d -p | cmp -s - test/input/1.txt && echo "TEST PASS" || echo "TEST FAILED"
+./apitest range && echo "TEST PASS" || echo "TEST FAILED"
+./apitest into && echo "TEST PASS" || echo "TEST FAILED"
+./apitest decode && echo "TEST PASS" || echo "TEST FAILED"
+./apitest context && echo "TEST PASS" || echo "TEST FAILED"
+./apitest batch && echo "TEST PASS" || echo "TEST FAILED"
@@ -0,0 +1,496 @@
+/*
+ * apitest checks the library functions huffcode doesn't reach. Each
+ * argument names a group of checks to run; failures are printed to
+ * standard error and make the exit status non-zero.
+ *
+ * Usage: apitest <group>...
+ *
+ * range  huffman_decode_range and huffman_decode_file_range
+ * into   huffman_encode_bound and huffman_encode_into
+ * decode huffman_decoded_size and huffman_decode_into, on version 2
+ *        streams and on test/input/1.v1, so run it from the top
+ *        directory
+ * context one encoder and one decoder context reused across inputs
+ * batch  huffman_encode_batch and huffman_decode_batch
+ */
+#include "../huffman.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The encoders cut their input into blocks of this many bytes. */
+#define BLOCK_SIZE (256 * 1024)
+
+static int failures;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                    __LINE__, #cond); \
+            ++failures; \
+        } \
+    } while(0)
+
+/*
+ * make_data fills a malloc'd buffer with len bytes of skewed, seeded
+ * data, so the encoders code it rather than storing it.
+ */
+static unsigned char*
+make_data(size_t len, uint64_t seed)
+{
+    static const char alphabet[] = "eeeeeetttaaoinshrdlu ,.\n";
+    unsigned char *buf = (unsigned char*)malloc(len ? len : 1);
+    size_t i;
+
+    for(i = 0; buf && i < len; ++i)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        buf[i] = (unsigned char)alphabet[(seed >> 33)
+                                         % (sizeof(alphabet) - 1)];
+    }
+
+    return buf;
+}
+
+static void
+test_range(void)
+{
+    static const struct
+    {
+        uint64_t offset;
+        size_t len;
+    } ranges[] =
+    {
+        { 0, 1 },
+        { BLOCK_SIZE - 100, 200 },
+        { 3 * BLOCK_SIZE / 2 - 1, 1 },
+        { 12345, 0 },
+        { 0, 3 * BLOCK_SIZE / 2 }
+    };
+    size_t len = 3 * BLOCK_SIZE / 2, enclen, i;
+    unsigned char *data = make_data(len, 1), *enc, *out;
+    FILE *f = tmpfile();
+
+    CHECK(data && f);
+    if(!data || !f
+       || huffman_encode_memory64(data, len, &enc, &enclen))
+    {
+        CHECK(!"encode");
+        return;
+    }
+    out = (unsigned char*)malloc(len + 1);
+
+    /* The file holds a few bytes before the stream, which the file
+       variant reads from the current position of. */
+    CHECK(fwrite("xyz", 1, 3, f) == 3);
+    CHECK(fwrite(enc, 1, enclen, f) == enclen);
+    CHECK(fseek(f, 3, SEEK_SET) == 0);
+
+    for(i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i)
+    {
+        uint64_t offset = ranges[i].offset;
+        size_t n = ranges[i].len;
+
+        memset(out, 0xAA, len + 1);
+        CHECK(huffman_decode_range(enc, enclen, offset, n, out) == 0);
+        CHECK(memcmp(out, data + offset, n) == 0);
+        CHECK(out[n] == 0xAA);
+
+        memset(out, 0xAA, len + 1);
+        CHECK(huffman_decode_file_range(f, offset, n, out) == 0);
+        CHECK(memcmp(out, data + offset, n) == 0);
+        CHECK(out[n] == 0xAA);
+        CHECK(ftell(f) == 3);
+    }
+
+    /* Ranges that run past the end fail. */
+    CHECK(huffman_decode_range(enc, enclen, len - 1, 2, out) != 0);
+    CHECK(huffman_decode_range(enc, enclen, len, 1, out) != 0);
+    CHECK(huffman_decode_file_range(f, len - 1, 2, out) != 0);
+    CHECK(huffman_decode_file_range(f, len + 10, 1, out) != 0);
+
+    fclose(f);
+    free(out);
+    free(enc);
+    free(data);
+}
+
+/*
+ * The inputs the buffer and context checks run on: empty, one byte,
+ * one repeated byte, short text, bytes that don't compress, and text
+ * of more than one block.
+ */
+#define NINPUTS 6
+
+static unsigned char*
+make_input(unsigned int k, size_t *plen)
+{
+    static const size_t lens[NINPUTS] =
+    {
+        0, 1, 5000, 300, 70000, 3 * BLOCK_SIZE / 2
+    };
+    unsigned char *buf;
+    size_t i;
+
+    *plen = lens[k];
+    buf = make_data(lens[k], k + 1);
+    if(!buf)
+        return NULL;
+
+    if(k == 2)
+    {
+        memset(buf, 'z', lens[k]);
+    }
+    else if(k == 4)
+    {
+        for(i = 0; i < lens[k]; ++i)
+            buf[i] = (unsigned char)((i * 2654435761u) >> 13);
+    }
+
+    return buf;
+}
+
+/* Bytes checked past the end of an undersized output buffer. */
+#define GUARD 16
+
+static void
+test_into(void)
+{
+    unsigned int k;
+
+    for(k = 0; k < NINPUTS; ++k)
+    {
+        size_t len, bound, enclen = 0, outlen, i;
+        unsigned char *in = make_input(k, &len), *out, *dec;
+        int guarded = 1;
+
+        bound = huffman_encode_bound(len);
+        CHECK(in && bound > 0);
+        out = (unsigned char*)malloc(bound + GUARD);
+        if(!in || !out || bound == 0)
+        {
+            free(in);
+            free(out);
+            continue;
+        }
+
+        CHECK(huffman_encode_into(in, len, out, bound, &enclen, NULL) == 0);
+        CHECK(enclen > 0 && enclen <= bound);
+
+        /* An exact fit works and gives the same bytes. */
+        dec = (unsigned char*)malloc(enclen);
+        CHECK(dec != NULL);
+        if(dec)
+        {
+            CHECK(huffman_encode_into(in, len, dec, enclen, &outlen,
+                                      NULL) == 0);
+            CHECK(outlen == enclen && memcmp(dec, out, enclen) == 0);
+            free(dec);
+        }
+
+        /* A byte short fails without writing past the buffer. */
+        memset(out, 0xAA, bound + GUARD);
+        CHECK(huffman_encode_into(in, len, out, enclen - 1, &outlen,
+                                  NULL) != 0);
+        for(i = enclen - 1; i < bound + GUARD; ++i)
+            guarded &= out[i] == 0xAA;
+        CHECK(guarded);
+
+        free(out);
+        free(in);
+    }
+}
+
+/*
+ * check_decode checks that the stream at enc decodes to the len bytes
+ * at data, that huffman_decoded_size reports len, and that an output
+ * buffer a byte short is refused.
+ */
+static void
+check_decode(const unsigned char *enc, size_t enclen,
+             const unsigned char *data, size_t len)
+{
+    unsigned char *out = (unsigned char*)malloc(len + GUARD);
+    uint64_t size = 0;
+    size_t outlen = 0, i;
+    int guarded = 1;
+
+    CHECK(out != NULL);
+    if(!out)
+        return;
+
+    CHECK(huffman_decoded_size(enc, enclen, &size) == 0);
+    CHECK(size == len);
+
+    memset(out, 0xAA, len + GUARD);
+    CHECK(huffman_decode_into(enc, enclen, out, len, &outlen) == 0);
+    CHECK(outlen == len && memcmp(out, data, len) == 0);
+    for(i = len; i < len + GUARD; ++i)
+        guarded &= out[i] == 0xAA;
+    CHECK(guarded);
+
+    if(len > 0)
+        CHECK(huffman_decode_into(enc, enclen, out, len - 1, &outlen) != 0);
+
+    free(out);
+}
+
+/*
+ * read_file reads the whole of path into a malloc'd buffer.
+ */
+static unsigned char*
+read_file(const char *path, size_t *plen)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *buf = NULL;
+    long len;
+
+    if(!f)
+        return NULL;
+
+    if(fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0
+       && fseek(f, 0, SEEK_SET) == 0)
+    {
+        buf = (unsigned char*)malloc(len ? (size_t)len : 1);
+        if(buf && fread(buf, 1, (size_t)len, f) != (size_t)len)
+        {
+            free(buf);
+            buf = NULL;
+        }
+        *plen = (size_t)len;
+    }
+
+    fclose(f);
+    return buf;
+}
+
+static void
+test_decode(void)
+{
+    unsigned char *data, *enc;
+    size_t len, enclen;
+    unsigned int k;
+
+    for(k = 0; k < NINPUTS; ++k)
+    {
+        data = make_input(k, &len);
+        CHECK(data != NULL);
+        if(!data)
+            continue;
+
+        if(huffman_encode_memory64(data, len, &enc, &enclen) == 0)
+        {
+            check_decode(enc, enclen, data, len);
+            free(enc);
+        }
+        else
+        {
+            CHECK(!"encode");
+        }
+
+        free(data);
+    }
+
+    /* A version 1 stream, as the old encoder wrote. */
+    data = read_file("test/input/1.txt", &len);
+    enc = read_file("test/input/1.v1", &enclen);
+    CHECK(data && enc);
+    if(data && enc)
+        check_decode(enc, enclen, data, len);
+    free(enc);
+    free(data);
+}
+
+static void
+test_context(void)
+{
+    /* Sizes go up and down, so calls reuse buffers earlier ones grew. */
+    static const unsigned int order[] = { 5, 3, 0, 4, 1, 2, 3, 5, 0 };
+    huffman_encoder_ctx *ectx = huffman_encoder_create(NULL);
+    huffman_decoder_ctx *dctx = huffman_decoder_create();
+    size_t i;
+
+    CHECK(ectx && dctx);
+    for(i = 0; ectx && dctx && i < sizeof(order) / sizeof(order[0]); ++i)
+    {
+        const unsigned char *enc, *dec;
+        size_t len, enclen, declen = 0;
+        unsigned char *data = make_input(order[i], &len);
+        unsigned char *out = (unsigned char*)malloc(len ? len : 1);
+
+        CHECK(data && out);
+        if(data && out
+           && huffman_encoder_encode(ectx, data, len, &enc, &enclen) == 0)
+        {
+            CHECK(huffman_decoder_decode(dctx, enc, enclen, &dec,
+                                         &declen) == 0);
+            CHECK(declen == len && memcmp(dec, data, len) == 0);
+
+            declen = 0;
+            CHECK(huffman_decoder_decode_into(dctx, enc, enclen, out, len,
+                                              &declen) == 0);
+            CHECK(declen == len && memcmp(out, data, len) == 0);
+        }
+        else
+        {
+            CHECK(!"encode");
+        }
+
+        free(out);
+        free(data);
+    }
+
+    huffman_decoder_free(dctx);
+    huffman_encoder_free(ectx);
+}
+
+/*
+ * check_batch encodes the n records at in as a batch, with a table
+ * built from them if withtable is set, decodes it back and checks each
+ * record. It then cuts the last record short and checks the batch is
+ * refused.
+ */
+static void
+check_batch(const huffman_buffer *in, size_t n, int withtable,
+            unsigned int threads)
+{
+    huffman_table *table = NULL;
+    huffman_options opts;
+    unsigned char *enc, *dec;
+    size_t *encoffsets, *decoffsets, *cut, last, i;
+
+    huffman_options_init(&opts);
+    opts.threads = threads;
+
+    if(huffman_encode_batch(in, n, &opts, withtable ? &table : NULL, &enc,
+                            &encoffsets))
+    {
+        CHECK(!"encode");
+        return;
+    }
+    CHECK(!withtable || table != NULL);
+
+    if(huffman_decode_batch(enc, encoffsets, n, table, &opts, &dec,
+                            &decoffsets) == 0)
+    {
+        for(i = 0; i < n; ++i)
+        {
+            CHECK(decoffsets[i + 1] - decoffsets[i] == in[i].len);
+            CHECK(memcmp(dec + decoffsets[i], in[i].data, in[i].len) == 0);
+        }
+        free(decoffsets);
+        free(dec);
+    }
+    else
+    {
+        CHECK(!"decode");
+    }
+
+    /* Drop the last byte of the last record, then half of it. That
+       record is one block, so what is lost is coded data or the end
+       byte; the index after the blocks of a longer stream is only read
+       to seek, so losing that alone does not fail a decode. */
+    cut = (size_t*)malloc((n + 1) * sizeof(*cut));
+    CHECK(cut != NULL);
+    if(cut)
+    {
+        memcpy(cut, encoffsets, (n + 1) * sizeof(*cut));
+        last = encoffsets[n] - encoffsets[n - 1];
+
+        for(i = 0; i < 2; ++i)
+        {
+            cut[n] = encoffsets[n] - (i == 0 ? 1 : last / 2);
+            if(huffman_decode_batch(enc, cut, n, table, &opts, &dec,
+                                    &decoffsets) == 0)
+            {
+                CHECK(!"truncated batch decoded");
+                free(decoffsets);
+                free(dec);
+            }
+        }
+        free(cut);
+    }
+
+    huffman_table_free(table);
+    free(encoffsets);
+    free(enc);
+}
+
+static void
+test_batch(void)
+{
+    /* Records of mixed lengths, empty ones among them. */
+    static const unsigned int inputs[] = { 0, 3, 1, 0, 5, 2, 0, 3, 4 };
+    enum { NRECORDS = sizeof(inputs) / sizeof(inputs[0]) };
+    huffman_buffer in[NRECORDS];
+    unsigned char *data[NRECORDS];
+    size_t i;
+    int ok = 1;
+
+    for(i = 0; i < NRECORDS; ++i)
+    {
+        data[i] = make_input(inputs[i], &in[i].len);
+        in[i].data = data[i];
+        ok &= data[i] != NULL;
+    }
+
+    CHECK(ok);
+    if(ok)
+    {
+        check_batch(in, NRECORDS, 0, 1);
+        check_batch(in, NRECORDS, 0, 4);
+        check_batch(in, NRECORDS, 1, 1);
+        check_batch(in, NRECORDS, 1, 4);
+    }
+
+    for(i = 0; i < NRECORDS; ++i)
+        free(data[i]);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    if(argc < 2)
+    {
+        fputs("Usage: apitest <group>...\n", stderr);
+        return 1;
+    }
+
+    for(i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "range") == 0)
+        {
+            test_range();
+        }
+        else if(strcmp(argv[i], "into") == 0)
+        {
+            test_into();
+        }
+        else if(strcmp(argv[i], "decode") == 0)
+        {
+            test_decode();
+        }
+        else if(strcmp(argv[i], "context") == 0)
+        {
+            test_context();
+        }
+        else if(strcmp(argv[i], "batch") == 0)
+        {
+            test_batch();
+        }
+        else
+        {
+            fprintf(stderr, "Unknown test group '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
+    return failures != 0;
+}